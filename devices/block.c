@@ -3,7 +3,27 @@
 #include <string.h>
 #include <stdio.h>
 #include "devices/ide.h"
+#include "devices/timer.h"
 #include "threads/malloc.h"
+#include "threads/thread.h"
+
+/* Most sectors the dispatch thread merges into one transfer. */
+#define BLOCK_MERGE_MAX 64
+
+/* Buckets in a latency histogram.  Bucket I counts requests that
+   took 2**I to 2**(I+1) - 1 microseconds, except that bucket 0
+   also counts faster ones and the last bucket slower ones. */
+#define LATENCY_BUCKETS 24
+
+/* Statistics for requests in one direction on a block device. */
+struct io_stats
+  {
+    unsigned long long requests;        /* Requests completed. */
+    unsigned long long bytes;           /* Bytes transferred. */
+    unsigned long long total_us;        /* Sum of latencies. */
+    unsigned long long max_us;          /* Longest latency. */
+    unsigned long long latency[LATENCY_BUCKETS]; /* Histogram. */
+  };
 
 /* A block device. */
 struct block
@@ -19,6 +39,24 @@ struct block
 
     unsigned long long read_cnt;        /* Number of sectors read. */
     unsigned long long write_cnt;       /* Number of sectors written. */
+
+    /* Request queue, served by a dispatch thread.  Devices with a
+       REMAP operation have none. */
+    struct list queue;                  /* Pending block_requests. */
+    struct lock queue_lock;             /* Protects QUEUE and HEAD. */
+    struct condition queue_cond;        /* Signaled when QUEUE nonempty. */
+    block_sector_t head;                /* Sector after last transfer. */
+
+    /* Statistics, protected by QUEUE_LOCK.  Requests count
+       toward the device they were submitted to as well as the
+       device that queued them.  Latency runs from submission to
+       completion, so it includes time spent queued.  Queue depth
+       counts requests queued or in transfer, as seen by each
+       arriving request. */
+    struct io_stats io[2];              /* Reads, then writes. */
+    int depth;                          /* Requests queued or in transfer. */
+    int max_depth;                      /* Largest DEPTH seen. */
+    unsigned long long depth_sum;       /* Sum of DEPTH seen on arrival. */
   };
 
 /* List of all block devices. */
@@ -28,6 +66,7 @@ static struct list all_blocks = LIST_INITIALIZER (all_blocks);
 static struct block *block_by_role[BLOCK_ROLE_CNT];
 
 static struct block *list_elem_to_block (struct list_elem *);
+static thread_func dispatch_thread NO_RETURN;
 
 /* Returns a human-readable name for the given block device
    TYPE. */
@@ -113,6 +152,16 @@ check_sector (struct block *block, block_sector_t sector)
     }
 }
 
+/* Verifies that the CNT sectors starting at SECTOR all lie within
+   BLOCK.  Panics if not. */
+static void
+check_sectors (struct block *block, block_sector_t sector, size_t cnt)
+{
+  ASSERT (cnt > 0);
+  check_sector (block, sector);
+  check_sector (block, sector + cnt - 1);
+}
+
 /* Reads sector SECTOR from BLOCK into BUFFER, which must
    have room for BLOCK_SECTOR_SIZE bytes.
    Internally synchronizes accesses to block devices, so external
@@ -120,9 +169,7 @@ check_sector (struct block *block, block_sector_t sector)
 void
 block_read (struct block *block, block_sector_t sector, void *buffer)
 {
-  check_sector (block, sector);
-  block->ops->read (block->aux, sector, buffer);
-  block->read_cnt++;
+  block_read_multiple (block, sector, buffer, 1);
 }
 
 /* Write sector SECTOR to BLOCK from BUFFER, which must contain
@@ -133,10 +180,312 @@ block_read (struct block *block, block_sector_t sector, void *buffer)
 void
 block_write (struct block *block, block_sector_t sector, const void *buffer)
 {
-  check_sector (block, sector);
-  ASSERT (block->type != BLOCK_FOREIGN);
-  block->ops->write (block->aux, sector, buffer);
-  block->write_cnt++;
+  block_write_multiple (block, sector, buffer, 1);
+}
+
+/* Reads the CNT sectors starting at SECTOR from BLOCK into
+   BUFFER, which must have room for CNT * BLOCK_SECTOR_SIZE bytes.
+   Drivers that support it move the whole run in as few commands
+   as they can.
+   Internally synchronizes accesses to block devices, so external
+   per-block device locking is unneeded. */
+void
+block_read_multiple (struct block *block, block_sector_t sector,
+                     void *buffer, size_t cnt)
+{
+  struct block_request req;
+
+  block_request_init (&req, false, sector, buffer, cnt);
+  block_submit (block, &req);
+  block_wait (&req);
+}
+
+/* Writes the CNT sectors starting at SECTOR to BLOCK from BUFFER,
+   which must contain CNT * BLOCK_SECTOR_SIZE bytes.  Returns after
+   the block device has acknowledged receiving the data.
+   Internally synchronizes accesses to block devices, so external
+   per-block device locking is unneeded. */
+void
+block_write_multiple (struct block *block, block_sector_t sector,
+                      const void *buffer, size_t cnt)
+{
+  struct block_request req;
+
+  block_request_init (&req, true, sector, (void *) buffer, cnt);
+  block_submit (block, &req);
+  block_wait (&req);
+}
+
+/* Initializes REQ as a request to transfer the CNT sectors
+   starting at SECTOR to BUFFER, if WRITE is false, or from
+   BUFFER, if WRITE is true. */
+void
+block_request_init (struct block_request *req, bool write,
+                    block_sector_t sector, void *buffer, size_t cnt)
+{
+  req->write = write;
+  req->sector = sector;
+  req->cnt = cnt;
+  req->buffer = buffer;
+  sema_init (&req->done, 0);
+  req->origin = NULL;
+  req->start_us = 0;
+}
+
+/* Queues REQ on BLOCK and returns without waiting for it.  REQ
+   and its buffer must stay put until block_wait() returns. */
+void
+block_submit (struct block *block, struct block_request *req)
+{
+  req->origin = block;
+  req->start_us = timer_usec ();
+
+  /* Pass requests on windows onto other devices through. */
+  for (;;)
+    {
+      check_sectors (block, req->sector, req->cnt);
+      if (req->write)
+        {
+          ASSERT (block->type != BLOCK_FOREIGN);
+          block->write_cnt += req->cnt;
+        }
+      else
+        block->read_cnt += req->cnt;
+      if (block->ops->remap == NULL)
+        break;
+      block = block->ops->remap (block->aux, &req->sector);
+    }
+
+  lock_acquire (&block->queue_lock);
+  list_push_back (&block->queue, &req->elem);
+  block->depth++;
+  block->depth_sum += block->depth;
+  if (block->depth > block->max_depth)
+    block->max_depth = block->depth;
+  cond_signal (&block->queue_cond, &block->queue_lock);
+  lock_release (&block->queue_lock);
+}
+
+/* Waits until REQ, which must have been passed to block_submit(),
+   is complete. */
+void
+block_wait (struct block_request *req)
+{
+  sema_down (&req->done);
+}
+
+/* Returns true if A and B touch a common sector and at least one
+   of them writes it, so that they must be served in order. */
+static bool
+conflicts (const struct block_request *a, const struct block_request *b)
+{
+  return ((a->write || b->write)
+          && a->sector < b->sector + b->cnt
+          && b->sector < a->sector + a->cnt);
+}
+
+/* Returns the first request in BLOCK's queue that was submitted
+   before REQ and conflicts with it, or a null pointer if there is
+   none.  BLOCK's queue_lock must be held. */
+static struct block_request *
+earlier_conflict (struct block *block, struct block_request *req)
+{
+  struct list_elem *e;
+
+  for (e = list_begin (&block->queue); e != &req->elem; e = list_next (e))
+    {
+      struct block_request *r = list_entry (e, struct block_request, elem);
+      if (conflicts (r, req))
+        return r;
+    }
+  return NULL;
+}
+
+/* Picks the request in BLOCK's nonempty queue to serve next, by
+   C-LOOK: the one with the lowest sector at or after the end of
+   the last transfer, or else the lowest sector of all, so that the
+   disk sweeps upward and then jumps back.  A request is never
+   served before an earlier conflicting one.
+   BLOCK's queue_lock must be held. */
+static struct block_request *
+pick_request (struct block *block)
+{
+  struct block_request *ahead = NULL, *lowest = NULL, *req, *earlier;
+  struct list_elem *e;
+
+  for (e = list_begin (&block->queue); e != list_end (&block->queue);
+       e = list_next (e))
+    {
+      struct block_request *r = list_entry (e, struct block_request, elem);
+      if (r->sector >= block->head
+          && (ahead == NULL || r->sector < ahead->sector))
+        ahead = r;
+      if (lowest == NULL || r->sector < lowest->sector)
+        lowest = r;
+    }
+
+  req = ahead != NULL ? ahead : lowest;
+  while ((earlier = earlier_conflict (block, req)) != NULL)
+    req = earlier;
+  return req;
+}
+
+/* Moves the next request to serve from BLOCK's nonempty queue to
+   BATCH, followed by any requests in the same direction that
+   continue it sector by sector, up to MAX sectors in all.
+   Returns the number of sectors in BATCH.
+   BLOCK's queue_lock must be held. */
+static size_t
+take_batch (struct block *block, struct list *batch, size_t max)
+{
+  struct block_request *first = pick_request (block);
+  size_t cnt = first->cnt;
+  struct list_elem *e;
+
+  list_remove (&first->elem);
+  list_push_back (batch, &first->elem);
+
+  e = list_begin (&block->queue);
+  while (e != list_end (&block->queue))
+    {
+      struct block_request *r = list_entry (e, struct block_request, elem);
+
+      if (r->write == first->write
+          && r->sector == first->sector + cnt
+          && cnt + r->cnt <= max
+          && earlier_conflict (block, r) == NULL)
+        {
+          list_remove (e);
+          list_push_back (batch, e);
+          cnt += r->cnt;
+
+          /* Look again for a request that continues this one. */
+          e = list_begin (&block->queue);
+        }
+      else
+        e = list_next (e);
+    }
+
+  block->head = first->sector + cnt;
+  return cnt;
+}
+
+/* Has BLOCK's driver transfer the CNT sectors starting at SECTOR
+   to BUFFER, or from BUFFER if WRITE is true. */
+static void
+transfer (struct block *block, bool write, block_sector_t sector,
+          void *buffer, size_t cnt)
+{
+  const struct block_operations *ops = block->ops;
+  size_t i;
+
+  if (write && ops->write_multiple != NULL)
+    ops->write_multiple (block->aux, sector, buffer, cnt);
+  else if (!write && ops->read_multiple != NULL)
+    ops->read_multiple (block->aux, sector, buffer, cnt);
+  else
+    for (i = 0; i < cnt; i++)
+      {
+        uint8_t *p = (uint8_t *) buffer + i * BLOCK_SECTOR_SIZE;
+        if (write)
+          ops->write (block->aux, sector + i, p);
+        else
+          ops->read (block->aux, sector + i, p);
+      }
+}
+
+/* Adds REQ, which completed at time NOW_US, to the statistics of
+   BLOCK. */
+static void
+account (struct block *block, const struct block_request *req,
+         int64_t now_us)
+{
+  struct io_stats *io = &block->io[req->write];
+  unsigned long long us = now_us > req->start_us ? now_us - req->start_us : 0;
+  unsigned long long rest;
+  int bucket = 0;
+
+  for (rest = us; rest >= 2 && bucket < LATENCY_BUCKETS - 1; rest >>= 1)
+    bucket++;
+
+  lock_acquire (&block->queue_lock);
+  io->requests++;
+  io->bytes += (unsigned long long) req->cnt * BLOCK_SECTOR_SIZE;
+  io->total_us += us;
+  if (us > io->max_us)
+    io->max_us = us;
+  io->latency[bucket]++;
+  lock_release (&block->queue_lock);
+}
+
+/* Dispatch thread for block device BLOCK_.  Serves batches of
+   requests from its queue one at a time.  A batch of several
+   requests goes through a bounce buffer, so that it reaches the
+   driver as one transfer. */
+static void
+dispatch_thread (void *block_)
+{
+  struct block *block = block_;
+  uint8_t *bounce = malloc (BLOCK_MERGE_MAX * BLOCK_SECTOR_SIZE);
+
+  for (;;)
+    {
+      struct block_request *first;
+      struct list batch;
+      struct list_elem *e;
+      int64_t now_us;
+      size_t cnt;
+
+      list_init (&batch);
+      lock_acquire (&block->queue_lock);
+      while (list_empty (&block->queue))
+        cond_wait (&block->queue_cond, &block->queue_lock);
+      cnt = take_batch (block, &batch, bounce != NULL ? BLOCK_MERGE_MAX : 0);
+      lock_release (&block->queue_lock);
+
+      first = list_entry (list_front (&batch), struct block_request, elem);
+      if (list_front (&batch) == list_back (&batch))
+        transfer (block, first->write, first->sector, first->buffer, cnt);
+      else
+        {
+          uint8_t *p;
+
+          if (first->write)
+            for (e = list_begin (&batch), p = bounce; e != list_end (&batch);
+                 e = list_next (e))
+              {
+                struct block_request *r
+                  = list_entry (e, struct block_request, elem);
+                memcpy (p, r->buffer, r->cnt * BLOCK_SECTOR_SIZE);
+                p += r->cnt * BLOCK_SECTOR_SIZE;
+              }
+          transfer (block, first->write, first->sector, bounce, cnt);
+          if (!first->write)
+            for (e = list_begin (&batch), p = bounce; e != list_end (&batch);
+                 e = list_next (e))
+              {
+                struct block_request *r
+                  = list_entry (e, struct block_request, elem);
+                memcpy (r->buffer, p, r->cnt * BLOCK_SECTOR_SIZE);
+                p += r->cnt * BLOCK_SECTOR_SIZE;
+              }
+        }
+
+      /* A waiter may free its request as soon as it is up'd. */
+      now_us = timer_usec ();
+      while (!list_empty (&batch))
+        {
+          struct block_request *r
+            = list_entry (list_pop_front (&batch), struct block_request, elem);
+          account (block, r, now_us);
+          if (r->origin != block)
+            account (r->origin, r, now_us);
+          lock_acquire (&block->queue_lock);
+          block->depth--;
+          lock_release (&block->queue_lock);
+          sema_up (&r->done);
+        }
+    }
 }
 
 /* Returns the number of sectors in BLOCK. */
@@ -160,20 +509,63 @@ block_type (struct block *block)
   return block->type;
 }
 
-/* Prints statistics for each block device used for a Pintos role. */
+/* Prints the statistics in IO for requests in direction NAME. */
+static void
+print_io_stats (const char *name, const struct io_stats *io)
+{
+  int i;
+
+  if (io->requests == 0)
+    return;
+  printf ("  %s: %llu requests, %llu bytes, avg %llu us, max %llu us\n",
+          name, io->requests, io->bytes, io->total_us / io->requests,
+          io->max_us);
+  printf ("    latency:");
+  for (i = 0; i < LATENCY_BUCKETS; i++)
+    if (io->latency[i] != 0)
+      {
+        if (i == 0)
+          printf (" <2 us: %llu", io->latency[i]);
+        else if (i == LATENCY_BUCKETS - 1)
+          printf (" %llu+ us: %llu", 1ULL << i, io->latency[i]);
+        else
+          printf (" %llu-%llu us: %llu",
+                  1ULL << i, (1ULL << (i + 1)) - 1, io->latency[i]);
+      }
+  printf ("\n");
+}
+
+/* Prints statistics for each block device used for a Pintos
+   role or that has seen any I/O: sector counts, then request
+   counts, bytes and a log2 histogram of latencies for each
+   direction, then the depth of the device's request queue. */
 void
 block_print_stats (void)
 {
-  int i;
+  struct list_elem *e;
 
-  for (i = 0; i < BLOCK_ROLE_CNT; i++)
+  for (e = list_begin (&all_blocks); e != list_end (&all_blocks);
+       e = list_next (e))
     {
-      struct block *block = block_by_role[i];
-      if (block != NULL)
+      struct block *block = list_entry (e, struct block, list_elem);
+      bool has_role = (block->type < BLOCK_ROLE_CNT
+                       && block_by_role[block->type] == block);
+
+      if (!has_role && block->read_cnt == 0 && block->write_cnt == 0)
+        continue;
+      printf ("%s (%s): %llu reads, %llu writes\n",
+              block->name, block_type_name (block->type),
+              block->read_cnt, block->write_cnt);
+      print_io_stats ("reads", &block->io[0]);
+      print_io_stats ("writes", &block->io[1]);
+      if (block->depth_sum > 0)
         {
-          printf ("%s (%s): %llu reads, %llu writes\n",
-                  block->name, block_type_name (block->type),
-                  block->read_cnt, block->write_cnt);
+          unsigned long long arrivals = block->io[0].requests
+                                        + block->io[1].requests
+                                        + block->depth;
+          unsigned long long avg = block->depth_sum * 100 / arrivals;
+          printf ("  queue depth: avg %llu.%02llu, max %d\n",
+                  avg / 100, avg % 100, block->max_depth);
         }
     }
 }
@@ -200,6 +592,17 @@ block_register (const char *name, enum block_type type,
   block->aux = aux;
   block->read_cnt = 0;
   block->write_cnt = 0;
+  list_init (&block->queue);
+  lock_init (&block->queue_lock);
+  cond_init (&block->queue_cond);
+  block->head = 0;
+  memset (block->io, 0, sizeof block->io);
+  block->depth = block->max_depth = 0;
+  block->depth_sum = 0;
+  if (ops->remap == NULL
+      && thread_create (block->name, PRI_DEFAULT, dispatch_thread, block)
+         == TID_ERROR)
+    PANIC ("Failed to start dispatch thread for %s", block->name);
 
   printf ("%s: %'"PRDSNu" sectors (", block->name, block->size);
   print_human_readable_size ((uint64_t) block->size * BLOCK_SECTOR_SIZE);
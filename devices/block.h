@@ -3,6 +3,8 @@
 
 #include <stddef.h>
 #include <inttypes.h>
+#include <list.h>
+#include "threads/synch.h"
 
 /* Size of a block device sector in bytes.
    All IDE disks use this sector size, as do most USB and SCSI
@@ -53,18 +55,59 @@ struct block *block_next (struct block *);
 block_sector_t block_size (struct block *);
 void block_read (struct block *, block_sector_t, void *);
 void block_write (struct block *, block_sector_t, const void *);
+void block_read_multiple (struct block *, block_sector_t, void *, size_t cnt);
+void block_write_multiple (struct block *, block_sector_t, const void *,
+                           size_t cnt);
 const char *block_name (struct block *);
 enum block_type block_type (struct block *);
 
+/* Asynchronous requests.
+   A request moves CNT sectors starting at SECTOR between a block
+   device and BUFFER.  Each device serves its requests from a
+   queue in elevator order, merging requests for adjacent sectors
+   into single transfers.  The synchronous functions above are
+   built on these. */
+struct block_request
+  {
+    struct list_elem elem;              /* Element in device's queue. */
+    bool write;                         /* Write to device? */
+    block_sector_t sector;              /* First sector. */
+    size_t cnt;                         /* Number of sectors. */
+    void *buffer;                       /* CNT * BLOCK_SECTOR_SIZE bytes. */
+    struct semaphore done;              /* Up'd when complete. */
+
+    /* For statistics. */
+    struct block *origin;               /* Device submitted to. */
+    int64_t start_us;                   /* timer_usec() at submission. */
+  };
+
+void block_request_init (struct block_request *, bool write,
+                         block_sector_t, void *buffer, size_t cnt);
+void block_submit (struct block *, struct block_request *);
+void block_wait (struct block_request *);
+
 /* Statistics. */
 void block_print_stats (void);
 
 /* Lower-level interface to block device drivers. */
 
+/* READ_MULTIPLE and WRITE_MULTIPLE transfer CNT consecutive
+   sectors at once.  A driver that cannot do better than one
+   sector at a time may leave them null.
+
+   A device that is a window onto another device, such as a
+   partition, instead supplies REMAP, which translates *SECTOR and
+   returns the device to pass the request on to.  Such a device
+   has no queue of its own. */
 struct block_operations
   {
     void (*read) (void *aux, block_sector_t, void *buffer);
     void (*write) (void *aux, block_sector_t, const void *buffer);
+    void (*read_multiple) (void *aux, block_sector_t, void *buffer,
+                           size_t cnt);
+    void (*write_multiple) (void *aux, block_sector_t, const void *buffer,
+                            size_t cnt);
+    struct block *(*remap) (void *aux, block_sector_t *sector);
   };
 
 struct block *block_register (const char *name, enum block_type,
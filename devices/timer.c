@@ -7,6 +7,9 @@
 #include "threads/interrupt.h"
 #include "threads/synch.h"
 #include "threads/thread.h"
+#ifdef FILESYS
+#include "filesys/cache.h"
+#endif
 
 /* See [8254] for hardware details of the 8254 timer chip. */
 
@@ -24,11 +27,16 @@ static int64_t ticks;
    Initialized by timer_calibrate(). */
 static unsigned loops_per_tick;
 
+/* Time stamp counter cycles per microsecond, or 0 if unknown.
+   Initialized by timer_calibrate(). */
+static uint64_t tsc_per_usec;
+
 static intr_handler_func timer_interrupt;
 static bool too_many_loops (unsigned loops);
 static void busy_wait (int64_t loops);
 static void real_time_sleep (int64_t num, int32_t denom);
 static void real_time_delay (int64_t num, int32_t denom);
+static uint64_t read_tsc (void);
 
 /* Sets up the timer to interrupt TIMER_FREQ times per second,
    and registers the corresponding interrupt. */
@@ -44,6 +52,8 @@ void
 timer_calibrate (void)
 {
   unsigned high_bit, test_bit;
+  int64_t start;
+  uint64_t tsc;
 
   ASSERT (intr_get_level () == INTR_ON);
   printf ("Calibrating timer...  ");
@@ -64,6 +74,28 @@ timer_calibrate (void)
       loops_per_tick |= test_bit;
 
   printf ("%'"PRIu64" loops/s.\n", (uint64_t) loops_per_tick * TIMER_FREQ);
+
+  /* Count time stamp counter cycles over one whole tick. */
+  start = timer_ticks ();
+  while (timer_ticks () == start)
+    barrier ();
+  tsc = read_tsc ();
+  start = timer_ticks ();
+  while (timer_ticks () == start)
+    barrier ();
+  tsc_per_usec = (read_tsc () - tsc) * TIMER_FREQ / 1000000;
+}
+
+/* Returns the number of microseconds since an arbitrary point
+   before boot, from the CPU's time stamp counter, for timing
+   short events.  Before timer_calibrate() has run, or if the
+   counter is too slow to be useful, falls back to timer ticks. */
+int64_t
+timer_usec (void)
+{
+  if (tsc_per_usec == 0)
+    return timer_ticks () * (1000000 / TIMER_FREQ);
+  return read_tsc () / tsc_per_usec;
 }
 
 /* Returns the number of timer ticks since the OS booted. */
@@ -172,6 +204,9 @@ timer_interrupt (struct intr_frame *args UNUSED)
 {
   ticks++;
   thread_tick ();
+#ifdef FILESYS
+  cache_tick (ticks);
+#endif
 }
 
 /* Returns true if LOOPS iterations waits for more than one timer
@@ -244,3 +279,12 @@ real_time_delay (int64_t num, int32_t denom)
   ASSERT (denom % 1000 == 0);
   busy_wait (loops_per_tick * num / 1000 * TIMER_FREQ / (denom / 1000));
 }
+
+/* Returns the CPU's time stamp counter. */
+static uint64_t
+read_tsc (void)
+{
+  uint64_t tsc;
+  asm volatile ("rdtsc" : "=A" (tsc));
+  return tsc;
+}
@@ -0,0 +1,679 @@
+#include "filesys/cache.h"
+#include <debug.h>
+#include <hash.h>
+#include <stdio.h>
+#include <string.h>
+#include "filesys/filesys.h"
+#include "filesys/journal.h"
+#include "threads/malloc.h"
+#include "threads/synch.h"
+#include "threads/thread.h"
+
+/* Sector number stored in a cache entry that holds no sector. */
+#define CACHE_NO_SECTOR ((block_sector_t) -1)
+
+/* Most write-backs cache_flush() has in flight at once. */
+#define FLUSH_BATCH 16
+
+/* How a cached sector takes part in the metadata journal.  A
+   sector in either of the last two states must not be written
+   home, so it is neither evicted nor flushed. */
+enum cache_log
+  {
+    LOG_NONE,                           /* Not in a transaction. */
+    LOG_RUNNING,                        /* Changed in running transaction. */
+    LOG_COMMITTING                      /* Being written to the log. */
+  };
+
+/* What a write stores, which decides when it may reach disk. */
+enum write_kind
+  {
+    WRITE_DATA,                         /* File data, written lazily. */
+    WRITE_NEW,                          /* Data of a newly allocated sector. */
+    WRITE_META                          /* Metadata, journaled. */
+  };
+
+/* A cached copy of one file system sector. */
+struct cache_entry
+  {
+    struct hash_elem hash_elem;         /* Element in cache_map. */
+    block_sector_t sector;              /* Cached sector or CACHE_NO_SECTOR. */
+    int pin_cnt;                        /* Number of threads using entry. */
+    bool accessed;                      /* Referenced since last sweep? */
+    bool dirty;                         /* Newer than the disk copy? */
+    bool fresh;                         /* Newly allocated file sector? */
+    enum cache_log log;                 /* Journal state. */
+
+    struct lock lock;                   /* Protects DATA, DIRTY, FRESH,
+                                           LOG. */
+    uint8_t data[BLOCK_SECTOR_SIZE];    /* Sector contents. */
+  };
+
+/* Number of entries to allocate at cache_init() time. */
+static size_t cache_cnt = CACHE_DEFAULT_SIZE;
+
+/* Cache entries and the clock hand that sweeps over them. */
+static struct cache_entry *cache;
+static size_t clock_hand;
+
+/* Maps sector numbers to the entries that hold them. */
+static struct hash cache_map;
+
+/* Protects cache_map, clock_hand, and each entry's SECTOR,
+   PIN_CNT and ACCESSED members.  Acquire before an entry's
+   LOCK, never while holding one. */
+static struct lock cache_lock;
+
+/* Sectors queued for the read-ahead thread, as a ring buffer.
+   Requests that arrive while the ring is full are dropped. */
+#define READAHEAD_QUEUE_SIZE 64
+static block_sector_t readahead_queue[READAHEAD_QUEUE_SIZE];
+static size_t readahead_head;           /* Next slot to fill. */
+static size_t readahead_cnt;            /* Number of queued sectors. */
+static struct lock readahead_lock;      /* Protects the ring. */
+static struct condition readahead_cond; /* Signaled when ring nonempty. */
+
+/* Number of dirty entries.  Protected by cache_lock.  Once more
+   than half the cache is dirty the flusher is woken early, so
+   that evictions rarely have to wait for a write-back. */
+static int dirty_cnt;
+
+/* The flusher thread waits on this semaphore.  It is up'd by the
+   timer interrupt every CACHE_FLUSH_INTERVAL ticks and by writers
+   when too much of the cache is dirty. */
+static struct semaphore flush_sema;
+static bool flusher_started;
+
+/* Statistics. */
+static unsigned long long hit_cnt;      /* Lookups satisfied in memory. */
+static unsigned long long miss_cnt;     /* Lookups that went to disk. */
+static unsigned long long writeback_cnt;/* Dirty sectors written back. */
+static unsigned long long prefetch_cnt; /* Sectors read ahead. */
+
+static hash_hash_func entry_hash;
+static hash_less_func entry_less;
+static struct cache_entry *cache_get (block_sector_t, bool will_overwrite);
+static struct cache_entry *cache_get_logged (block_sector_t);
+static void cache_put (struct cache_entry *);
+static void write_at (block_sector_t, const void *, off_t ofs, off_t size,
+                      enum write_kind);
+static bool flush (bool fresh_only);
+static bool is_logged (const struct cache_entry *);
+static struct cache_entry *choose_victim (void);
+static thread_func readahead_thread NO_RETURN;
+static thread_func flusher_thread NO_RETURN;
+
+/* Sets the number of sectors that cache_init() will allocate.
+   Called while parsing the kernel command line. */
+void
+cache_configure (size_t sector_cnt)
+{
+  cache_cnt = sector_cnt < CACHE_MIN_SIZE ? CACHE_MIN_SIZE : sector_cnt;
+}
+
+/* Returns the number of sectors the buffer cache holds. */
+size_t
+cache_size (void)
+{
+  return cache_cnt;
+}
+
+/* Initializes the buffer cache. */
+void
+cache_init (void)
+{
+  size_t i;
+
+  cache = malloc (cache_cnt * sizeof *cache);
+  if (cache == NULL || !hash_init (&cache_map, entry_hash, entry_less, NULL))
+    PANIC ("couldn't allocate %zu-sector buffer cache", cache_cnt);
+
+  for (i = 0; i < cache_cnt; i++)
+    {
+      struct cache_entry *e = &cache[i];
+      e->sector = CACHE_NO_SECTOR;
+      e->pin_cnt = 0;
+      e->accessed = false;
+      e->dirty = false;
+      e->fresh = false;
+      e->log = LOG_NONE;
+      lock_init (&e->lock);
+    }
+  clock_hand = 0;
+  lock_init (&cache_lock);
+
+  readahead_head = readahead_cnt = 0;
+  lock_init (&readahead_lock);
+  cond_init (&readahead_cond);
+  if (thread_create ("readahead", PRI_DEFAULT, readahead_thread, NULL)
+      == TID_ERROR)
+    PANIC ("couldn't start read-ahead thread");
+
+  dirty_cnt = 0;
+  sema_init (&flush_sema, 0);
+  if (thread_create ("flusher", PRI_DEFAULT, flusher_thread, NULL)
+      == TID_ERROR)
+    PANIC ("couldn't start flusher thread");
+  flusher_started = true;
+}
+
+/* Reads sector SECTOR of the file system device into BUFFER,
+   which must have room for BLOCK_SECTOR_SIZE bytes. */
+void
+cache_read (block_sector_t sector, void *buffer)
+{
+  cache_read_at (sector, buffer, 0, BLOCK_SECTOR_SIZE);
+}
+
+/* Reads SIZE bytes starting at byte offset OFS within sector
+   SECTOR into BUFFER. */
+void
+cache_read_at (block_sector_t sector, void *buffer, off_t ofs, off_t size)
+{
+  struct cache_entry *e;
+
+  ASSERT (ofs >= 0 && size >= 0 && ofs + size <= BLOCK_SECTOR_SIZE);
+
+  e = cache_get (sector, false);
+  memcpy (buffer, e->data + ofs, size);
+  cache_put (e);
+}
+
+/* Writes BLOCK_SECTOR_SIZE bytes from BUFFER into sector SECTOR.
+   The data reaches the disk when the entry is evicted or the
+   cache is flushed. */
+void
+cache_write (block_sector_t sector, const void *buffer)
+{
+  cache_write_at (sector, buffer, 0, BLOCK_SECTOR_SIZE);
+}
+
+/* Writes SIZE bytes from BUFFER into sector SECTOR, starting at
+   byte offset OFS within the sector. */
+void
+cache_write_at (block_sector_t sector, const void *buffer,
+                off_t ofs, off_t size)
+{
+  write_at (sector, buffer, ofs, size, WRITE_DATA);
+}
+
+/* Writes BLOCK_SECTOR_SIZE bytes from BUFFER into SECTOR, a data
+   sector just allocated to a file.  The sector reaches the disk
+   before the journal next commits, so that metadata making it
+   part of the file never reaches the disk ahead of it. */
+void
+cache_write_new (block_sector_t sector, const void *buffer)
+{
+  write_at (sector, buffer, 0, BLOCK_SECTOR_SIZE, WRITE_NEW);
+}
+
+/* Writes BLOCK_SECTOR_SIZE bytes from BUFFER into file system
+   metadata sector SECTOR.  The sector reaches the disk only after
+   the journal has committed it. */
+void
+cache_write_meta (block_sector_t sector, const void *buffer)
+{
+  write_at (sector, buffer, 0, BLOCK_SECTOR_SIZE, WRITE_META);
+}
+
+/* Writes SIZE bytes from BUFFER into metadata sector SECTOR,
+   starting at byte offset OFS within the sector. */
+void
+cache_write_meta_at (block_sector_t sector, const void *buffer,
+                     off_t ofs, off_t size)
+{
+  write_at (sector, buffer, ofs, size, WRITE_META);
+}
+
+/* Copies metadata sector SECTOR, which must be in the running
+   transaction, into BUFFER for the journal to log, and notes
+   that it is being committed.  Later changes to the sector go
+   into the next transaction. */
+void
+cache_log_snapshot (block_sector_t sector, void *buffer)
+{
+  struct cache_entry *e = cache_get_logged (sector);
+
+  memcpy (buffer, e->data, BLOCK_SECTOR_SIZE);
+  if (e->log == LOG_RUNNING)
+    e->log = LOG_COMMITTING;
+  cache_put (e);
+}
+
+/* Lets metadata sector SECTOR be written home, now that the
+   journal has committed it, unless it has changed again since
+   cache_log_snapshot(). */
+void
+cache_log_done (block_sector_t sector)
+{
+  struct cache_entry *e = cache_get_logged (sector);
+
+  if (e->log == LOG_COMMITTING)
+    e->log = LOG_NONE;
+  cache_put (e);
+}
+
+/* Returns true if metadata sector SECTOR has changed in a
+   transaction that the journal has not committed yet, so that
+   cache_flush() holds it back. */
+bool
+cache_log_pending (block_sector_t sector)
+{
+  struct cache_entry key;
+  struct hash_elem *found;
+  struct cache_entry *e;
+  bool pending;
+
+  /* Such a sector cannot have been evicted. */
+  lock_acquire (&cache_lock);
+  key.sector = sector;
+  found = hash_find (&cache_map, &key.hash_elem);
+  if (found == NULL)
+    {
+      lock_release (&cache_lock);
+      return false;
+    }
+  e = hash_entry (found, struct cache_entry, hash_elem);
+  e->pin_cnt++;
+  lock_release (&cache_lock);
+
+  lock_acquire (&e->lock);
+  pending = is_logged (e);
+  cache_put (e);
+  return pending;
+}
+
+/* Asks the read-ahead thread to bring SECTOR into the cache in
+   the background.  Returns without waiting.  The request is
+   silently dropped if the read-ahead thread is too far behind. */
+void
+cache_readahead (block_sector_t sector)
+{
+  lock_acquire (&readahead_lock);
+  if (readahead_cnt < READAHEAD_QUEUE_SIZE)
+    {
+      readahead_queue[readahead_head] = sector;
+      readahead_head = (readahead_head + 1) % READAHEAD_QUEUE_SIZE;
+      readahead_cnt++;
+      cond_signal (&readahead_cond, &readahead_lock);
+    }
+  lock_release (&readahead_lock);
+}
+
+/* Writes every dirty entry back to the file system device,
+   except metadata that the journal has not committed yet.
+   Returns true if no such metadata held anything back. */
+bool
+cache_flush (void)
+{
+  return flush (false);
+}
+
+/* Writes back the sectors written with cache_write_new() that
+   are still dirty.  The journal calls this before it commits. */
+void
+cache_flush_new (void)
+{
+  flush (true);
+}
+
+/* Writes dirty entries back to the file system device, except
+   metadata that the journal has not committed yet, and only
+   those written with cache_write_new() if FRESH_ONLY.  Entries
+   are written FLUSH_BATCH at a time, all queued before any is
+   waited for, so that the device can sort and merge them.
+   Returns true if no such metadata held anything back. */
+static bool
+flush (bool fresh_only)
+{
+  struct cache_entry *batch[FLUSH_BATCH];
+  struct block_request reqs[FLUSH_BATCH];
+  bool queued[FLUSH_BATCH];
+  bool all = true;
+  size_t i = 0;
+
+  if (cache == NULL)
+    return true;
+
+  while (i < cache_cnt)
+    {
+      size_t cnt = 0;
+      int written = 0;
+      size_t j;
+
+      /* Pin the next dirty entries. */
+      lock_acquire (&cache_lock);
+      for (; i < cache_cnt && cnt < FLUSH_BATCH; i++)
+        {
+          struct cache_entry *e = &cache[i];
+          if (e->sector != CACHE_NO_SECTOR && e->dirty
+              && (e->fresh || !fresh_only))
+            {
+              e->pin_cnt++;
+              batch[cnt++] = e;
+            }
+        }
+      lock_release (&cache_lock);
+
+      /* Queue their write-backs, holding each entry's lock until
+         its write completes. */
+      for (j = 0; j < cnt; j++)
+        {
+          struct cache_entry *e = batch[j];
+
+          lock_acquire (&e->lock);
+          queued[j] = false;
+          if (is_logged (e))
+            all = false;
+          else if (e->dirty)
+            {
+              block_request_init (&reqs[j], true, e->sector, e->data, 1);
+              block_submit (fs_device, &reqs[j]);
+              queued[j] = true;
+            }
+        }
+
+      for (j = 0; j < cnt; j++)
+        {
+          if (queued[j])
+            {
+              block_wait (&reqs[j]);
+              batch[j]->dirty = batch[j]->fresh = false;
+              writeback_cnt++;
+              written++;
+            }
+          lock_release (&batch[j]->lock);
+        }
+
+      lock_acquire (&cache_lock);
+      dirty_cnt -= written;
+      for (j = 0; j < cnt; j++)
+        batch[j]->pin_cnt--;
+      lock_release (&cache_lock);
+    }
+  return all;
+}
+
+/* Called by the timer interrupt handler at each timer tick, with
+   the number of ticks since boot.  Periodically wakes the flusher
+   thread so that dirty data does not linger in memory. */
+void
+cache_tick (int64_t ticks)
+{
+  if (flusher_started && ticks % CACHE_FLUSH_INTERVAL == 0)
+    sema_up (&flush_sema);
+}
+
+/* Prints buffer cache statistics. */
+void
+cache_print_stats (void)
+{
+  printf ("Buffer cache: %zu sectors, %llu hits, %llu misses, "
+          "%llu writebacks, %llu read ahead\n",
+          cache_cnt, hit_cnt, miss_cnt, writeback_cnt, prefetch_cnt);
+}
+
+/* Returns the entry caching SECTOR, pinned and with its lock
+   held, reading the sector from disk first if it is not already
+   cached.  If WILL_OVERWRITE is true the caller is about to
+   replace the whole sector, so a miss skips the disk read.
+   Release the entry with cache_put(). */
+static struct cache_entry *
+cache_get (block_sector_t sector, bool will_overwrite)
+{
+  struct cache_entry key;
+  struct hash_elem *found;
+  struct cache_entry *e;
+
+  ASSERT (sector != CACHE_NO_SECTOR);
+
+  lock_acquire (&cache_lock);
+  key.sector = sector;
+  for (;;)
+    {
+      found = hash_find (&cache_map, &key.hash_elem);
+      if (found != NULL)
+        {
+          /* Hit.  The entry cannot be evicted while it is pinned,
+             but another thread may still be reading it in, so wait
+             for its lock. */
+          e = hash_entry (found, struct cache_entry, hash_elem);
+          e->pin_cnt++;
+          e->accessed = true;
+          hit_cnt++;
+          lock_release (&cache_lock);
+          lock_acquire (&e->lock);
+          return e;
+        }
+
+      e = choose_victim ();
+      if (e == NULL)
+        {
+          /* Every entry is pinned.  Let the pinning threads
+             finish, then look again, since one of them may have
+             brought in SECTOR meanwhile. */
+          lock_release (&cache_lock);
+          thread_yield ();
+          lock_acquire (&cache_lock);
+          continue;
+        }
+
+      /* Nobody else has the victim pinned, so its lock is free
+         and its DIRTY member is stable. */
+      if (!e->dirty)
+        break;
+
+      /* Write back the dirty victim without holding cache_lock.
+         It keeps its old sector and stays in cache_map, pinned
+         and locked, so a thread that wants the old sector waits
+         for the write and then finds the entry intact instead of
+         reading stale data from disk.  Then look again, since
+         SECTOR may have been brought in meanwhile. */
+      e->pin_cnt++;
+      lock_acquire (&e->lock);
+      lock_release (&cache_lock);
+      block_write (fs_device, e->sector, e->data);
+      e->dirty = e->fresh = false;
+      lock_release (&e->lock);
+
+      lock_acquire (&cache_lock);
+      e->pin_cnt--;
+      writeback_cnt++;
+      dirty_cnt--;
+    }
+
+  /* Miss.  The victim is clean and unpinned, so it can be handed
+     over to SECTOR without any I/O under cache_lock. */
+  e->pin_cnt++;
+  lock_acquire (&e->lock);
+  if (e->sector != CACHE_NO_SECTOR)
+    hash_delete (&cache_map, &e->hash_elem);
+  e->sector = sector;
+  e->accessed = true;
+  e->dirty = e->fresh = false;
+  e->log = LOG_NONE;
+  hash_insert (&cache_map, &e->hash_elem);
+  miss_cnt++;
+  lock_release (&cache_lock);
+
+  /* The entry is pinned and locked, so it cannot be evicted and
+     threads that find it wait on its lock until the sector has
+     been read in, without cache_lock being held for the read. */
+  if (!will_overwrite)
+    block_read (fs_device, sector, e->data);
+  return e;
+}
+
+/* Returns the entry caching metadata sector SECTOR, pinned and
+   with its lock held, like cache_get().  The sector must be in
+   the journal, which keeps it from being evicted. */
+static struct cache_entry *
+cache_get_logged (block_sector_t sector)
+{
+  struct cache_entry key;
+  struct hash_elem *found;
+  struct cache_entry *e;
+
+  lock_acquire (&cache_lock);
+  key.sector = sector;
+  found = hash_find (&cache_map, &key.hash_elem);
+  ASSERT (found != NULL);
+  e = hash_entry (found, struct cache_entry, hash_elem);
+  e->pin_cnt++;
+  lock_release (&cache_lock);
+
+  lock_acquire (&e->lock);
+  return e;
+}
+
+/* Releases entry E obtained from cache_get(). */
+static void
+cache_put (struct cache_entry *e)
+{
+  lock_release (&e->lock);
+
+  lock_acquire (&cache_lock);
+  ASSERT (e->pin_cnt > 0);
+  e->pin_cnt--;
+  lock_release (&cache_lock);
+}
+
+/* Writes SIZE bytes from BUFFER into sector SECTOR at byte offset
+   OFS within the sector.  Metadata is added to the running
+   transaction if the file system is journaled. */
+static void
+write_at (block_sector_t sector, const void *buffer, off_t ofs, off_t size,
+          enum write_kind kind)
+{
+  struct cache_entry *e;
+  bool newly_dirty;
+  bool newly_logged = false;
+
+  ASSERT (ofs >= 0 && size >= 0 && ofs + size <= BLOCK_SECTOR_SIZE);
+
+  e = cache_get (sector, size == BLOCK_SECTOR_SIZE);
+  memcpy (e->data + ofs, buffer, size);
+  newly_dirty = !e->dirty;
+  e->dirty = true;
+  if (kind == WRITE_NEW)
+    e->fresh = true;
+  if (kind == WRITE_META && journal_active () && e->log != LOG_RUNNING)
+    {
+      e->log = LOG_RUNNING;
+      newly_logged = true;
+    }
+  cache_put (e);
+
+  if (newly_dirty)
+    {
+      lock_acquire (&cache_lock);
+      if (++dirty_cnt == (int) cache_cnt / 2 + 1)
+        sema_up (&flush_sema);
+      lock_release (&cache_lock);
+    }
+  if (newly_logged)
+    journal_add (sector);
+}
+
+/* Returns true if entry E holds metadata that must not be written
+   home until the journal commits it. */
+static bool
+is_logged (const struct cache_entry *e)
+{
+  return e->log != LOG_NONE && journal_active ();
+}
+
+/* Read-ahead thread.  Pulls sectors off readahead_queue and
+   reads each one into the cache, so that a sequential reader
+   finds it there instead of waiting on the disk. */
+static void
+readahead_thread (void *aux UNUSED)
+{
+  for (;;)
+    {
+      block_sector_t sector;
+      struct cache_entry key;
+      bool cached;
+
+      lock_acquire (&readahead_lock);
+      while (readahead_cnt == 0)
+        cond_wait (&readahead_cond, &readahead_lock);
+      sector = readahead_queue[(readahead_head + READAHEAD_QUEUE_SIZE
+                                - readahead_cnt) % READAHEAD_QUEUE_SIZE];
+      readahead_cnt--;
+      lock_release (&readahead_lock);
+
+      /* Don't disturb the statistics or the clock for sectors
+         that are already cached. */
+      lock_acquire (&cache_lock);
+      key.sector = sector;
+      cached = hash_find (&cache_map, &key.hash_elem) != NULL;
+      lock_release (&cache_lock);
+      if (!cached)
+        {
+          cache_put (cache_get (sector, false));
+          prefetch_cnt++;
+        }
+    }
+}
+
+/* Flusher thread.  Commits the journal, including the changed
+   parts of the free map, and then writes the dirty sectors back
+   to disk whenever flush_sema is up'd, so that writers only have
+   to wait for the buffer cache. */
+static void
+flusher_thread (void *aux UNUSED)
+{
+  for (;;)
+    {
+      sema_down (&flush_sema);
+      filesys_sync ();
+    }
+}
+
+/* Picks an unpinned entry to replace using the clock algorithm.
+   Entries referenced since the last sweep get a second chance.
+   Returns a null pointer if every entry is pinned.
+   Must be called with cache_lock held. */
+static struct cache_entry *
+choose_victim (void)
+{
+  size_t i;
+
+  ASSERT (lock_held_by_current_thread (&cache_lock));
+
+  /* Two full sweeps are enough to clear every reference bit. */
+  for (i = 0; i < 2 * cache_cnt; i++)
+    {
+      struct cache_entry *e = &cache[clock_hand];
+      clock_hand = (clock_hand + 1) % cache_cnt;
+
+      if (e->pin_cnt > 0 || is_logged (e))
+        continue;
+      if (e->sector != CACHE_NO_SECTOR && e->accessed)
+        {
+          e->accessed = false;
+          continue;
+        }
+      return e;
+    }
+  return NULL;
+}
+
+/* Returns a hash value for the sector held by cache entry E. */
+static unsigned
+entry_hash (const struct hash_elem *e, void *aux UNUSED)
+{
+  const struct cache_entry *ce = hash_entry (e, struct cache_entry,
+                                             hash_elem);
+  return hash_bytes (&ce->sector, sizeof ce->sector);
+}
+
+/* Returns true if cache entry A holds a lower sector than B. */
+static bool
+entry_less (const struct hash_elem *a, const struct hash_elem *b,
+            void *aux UNUSED)
+{
+  return (hash_entry (a, struct cache_entry, hash_elem)->sector
+          < hash_entry (b, struct cache_entry, hash_elem)->sector);
+}
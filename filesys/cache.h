@@ -0,0 +1,41 @@
+#ifndef FILESYS_CACHE_H
+#define FILESYS_CACHE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include "devices/block.h"
+#include "devices/timer.h"
+#include "filesys/off_t.h"
+
+/* Number of sectors held in the buffer cache unless overridden
+   on the kernel command line with -cache=N. */
+#define CACHE_DEFAULT_SIZE 64
+
+/* Smallest buffer cache we are willing to run with. */
+#define CACHE_MIN_SIZE 8
+
+/* Timer ticks between background flushes of dirty sectors. */
+#define CACHE_FLUSH_INTERVAL (5 * TIMER_FREQ)
+
+void cache_configure (size_t sector_cnt);
+size_t cache_size (void);
+void cache_init (void);
+bool cache_flush (void);
+void cache_flush_new (void);
+void cache_tick (int64_t ticks);
+void cache_print_stats (void);
+
+void cache_read (block_sector_t, void *);
+void cache_read_at (block_sector_t, void *, off_t ofs, off_t size);
+void cache_write (block_sector_t, const void *);
+void cache_write_at (block_sector_t, const void *, off_t ofs, off_t size);
+void cache_write_new (block_sector_t, const void *);
+void cache_write_meta (block_sector_t, const void *);
+void cache_write_meta_at (block_sector_t, const void *, off_t ofs, off_t size);
+void cache_readahead (block_sector_t);
+
+void cache_log_snapshot (block_sector_t, void *);
+void cache_log_done (block_sector_t);
+bool cache_log_pending (block_sector_t);
+
+#endif /* filesys/cache.h */
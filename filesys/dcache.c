@@ -0,0 +1,209 @@
+#include "filesys/dcache.h"
+#include <debug.h>
+#include <hash.h>
+#include <list.h>
+#include <string.h>
+#include "filesys/directory.h"
+#include "threads/malloc.h"
+#include "threads/synch.h"
+
+/* Directory entry cache.
+
+   Maps a (directory inode sector, name) pair to the sector of
+   the inode that the name refers to, or to DCACHE_NEGATIVE if the
+   directory is known to have no such name, so that resolving a
+   path does not have to search each directory along the way.
+
+   The directory code keeps the cache coherent: dir_add() and
+   dir_remove() record their changes with dcache_update(), and
+   removing a directory drops every name cached under it with
+   dcache_purge().  A lookup that misses searches the directory
+   and then records its result with dcache_fill().  Because that
+   search is not atomic with respect to directory changes, every
+   change bumps a generation number and dcache_fill() discards
+   results from searches that a change may have overtaken. */
+
+/* A cached name. */
+struct dcache_entry
+  {
+    struct hash_elem hash_elem;         /* Element in dcache_map. */
+    struct list_elem lru_elem;          /* Element in lru_list. */
+    block_sector_t parent;              /* Directory inode sector. */
+    char name[NAME_MAX + 1];            /* Name within PARENT. */
+    block_sector_t sector;              /* Inode sector or DCACHE_NEGATIVE. */
+  };
+
+static struct dcache_entry *entries;    /* DCACHE_SIZE entries. */
+static struct hash dcache_map;          /* Entries in use. */
+static struct list lru_list;            /* Entries, least recent first. */
+static struct list free_list;           /* Entries not in use. */
+static unsigned generation;             /* Bumped by every change. */
+static struct lock dcache_lock;         /* Protects all of the above. */
+
+static hash_hash_func entry_hash;
+static hash_less_func entry_less;
+static struct dcache_entry *find (block_sector_t parent, const char *name);
+static void store (block_sector_t parent, const char *name,
+                   block_sector_t sector);
+static void discard (struct dcache_entry *);
+
+/* Initializes the directory entry cache. */
+void
+dcache_init (void)
+{
+  size_t i;
+
+  entries = malloc (DCACHE_SIZE * sizeof *entries);
+  if (entries == NULL || !hash_init (&dcache_map, entry_hash, entry_less, NULL))
+    PANIC ("can't allocate directory entry cache");
+  list_init (&lru_list);
+  list_init (&free_list);
+  for (i = 0; i < DCACHE_SIZE; i++)
+    list_push_back (&free_list, &entries[i].lru_elem);
+  lock_init (&dcache_lock);
+}
+
+/* Looks up NAME in the directory whose inode is in sector PARENT.
+   If it is cached, stores the sector of its inode, or
+   DCACHE_NEGATIVE if it is known not to exist, in *SECTORP and
+   returns true.  Otherwise, stores a generation number to pass to
+   dcache_fill() in *GENP and returns false. */
+bool
+dcache_lookup (block_sector_t parent, const char *name,
+               block_sector_t *sectorp, unsigned *genp)
+{
+  struct dcache_entry *e;
+
+  lock_acquire (&dcache_lock);
+  e = find (parent, name);
+  if (e != NULL)
+    {
+      list_remove (&e->lru_elem);
+      list_push_back (&lru_list, &e->lru_elem);
+      *sectorp = e->sector;
+    }
+  else
+    *genp = generation;
+  lock_release (&dcache_lock);
+  return e != NULL;
+}
+
+/* Records that NAME in directory PARENT refers to the inode in
+   SECTOR, or does not exist if SECTOR is DCACHE_NEGATIVE, as
+   found by a directory search begun when dcache_lookup() returned
+   GEN.  Does nothing if any directory has changed since. */
+void
+dcache_fill (block_sector_t parent, const char *name,
+             block_sector_t sector, unsigned gen)
+{
+  lock_acquire (&dcache_lock);
+  if (gen == generation)
+    store (parent, name, sector);
+  lock_release (&dcache_lock);
+}
+
+/* Records that NAME in directory PARENT now refers to the inode
+   in SECTOR, or no longer exists if SECTOR is DCACHE_NEGATIVE. */
+void
+dcache_update (block_sector_t parent, const char *name,
+               block_sector_t sector)
+{
+  lock_acquire (&dcache_lock);
+  generation++;
+  store (parent, name, sector);
+  lock_release (&dcache_lock);
+}
+
+/* Forgets every name cached in directory PARENT, which is being
+   removed and whose sector may be reused. */
+void
+dcache_purge (block_sector_t parent)
+{
+  struct list_elem *e, *next;
+
+  lock_acquire (&dcache_lock);
+  generation++;
+  for (e = list_begin (&lru_list); e != list_end (&lru_list); e = next)
+    {
+      struct dcache_entry *d = list_entry (e, struct dcache_entry, lru_elem);
+      next = list_next (e);
+      if (d->parent == parent)
+        discard (d);
+    }
+  lock_release (&dcache_lock);
+}
+
+/* Returns the entry for NAME in PARENT, or a null pointer.
+   Must be called with dcache_lock held. */
+static struct dcache_entry *
+find (block_sector_t parent, const char *name)
+{
+  struct dcache_entry key;
+  struct hash_elem *e;
+
+  if (strlen (name) > NAME_MAX)
+    return NULL;
+  key.parent = parent;
+  strlcpy (key.name, name, sizeof key.name);
+  e = hash_find (&dcache_map, &key.hash_elem);
+  return e != NULL ? hash_entry (e, struct dcache_entry, hash_elem) : NULL;
+}
+
+/* Makes NAME in PARENT map to SECTOR, replacing the least
+   recently used entry if the cache is full.
+   Must be called with dcache_lock held. */
+static void
+store (block_sector_t parent, const char *name, block_sector_t sector)
+{
+  struct dcache_entry *e = find (parent, name);
+
+  if (e == NULL)
+    {
+      if (strlen (name) > NAME_MAX)
+        return;
+      if (list_empty (&free_list))
+        discard (list_entry (list_front (&lru_list),
+                             struct dcache_entry, lru_elem));
+      e = list_entry (list_pop_front (&free_list),
+                      struct dcache_entry, lru_elem);
+      e->parent = parent;
+      strlcpy (e->name, name, sizeof e->name);
+      hash_insert (&dcache_map, &e->hash_elem);
+    }
+  else
+    list_remove (&e->lru_elem);
+  e->sector = sector;
+  list_push_back (&lru_list, &e->lru_elem);
+}
+
+/* Moves E from the cache to the free list.
+   Must be called with dcache_lock held. */
+static void
+discard (struct dcache_entry *e)
+{
+  hash_delete (&dcache_map, &e->hash_elem);
+  list_remove (&e->lru_elem);
+  list_push_back (&free_list, &e->lru_elem);
+}
+
+/* Returns a hash value for the entry that contains E. */
+static unsigned
+entry_hash (const struct hash_elem *e, void *aux UNUSED)
+{
+  const struct dcache_entry *d = hash_entry (e, struct dcache_entry, hash_elem);
+  return hash_string (d->name) ^ hash_int (d->parent);
+}
+
+/* Returns true if the entry that contains A precedes the one
+   that contains B. */
+static bool
+entry_less (const struct hash_elem *a_, const struct hash_elem *b_,
+            void *aux UNUSED)
+{
+  const struct dcache_entry *a = hash_entry (a_, struct dcache_entry, hash_elem);
+  const struct dcache_entry *b = hash_entry (b_, struct dcache_entry, hash_elem);
+
+  if (a->parent != b->parent)
+    return a->parent < b->parent;
+  return strcmp (a->name, b->name) < 0;
+}
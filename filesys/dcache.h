@@ -0,0 +1,22 @@
+#ifndef FILESYS_DCACHE_H
+#define FILESYS_DCACHE_H
+
+#include <stdbool.h>
+#include "devices/block.h"
+
+/* Number of names held in the directory entry cache. */
+#define DCACHE_SIZE 256
+
+/* Sector recorded for a name known not to exist. */
+#define DCACHE_NEGATIVE ((block_sector_t) -1)
+
+void dcache_init (void);
+bool dcache_lookup (block_sector_t parent, const char *name,
+                    block_sector_t *sectorp, unsigned *genp);
+void dcache_fill (block_sector_t parent, const char *name,
+                  block_sector_t sector, unsigned gen);
+void dcache_update (block_sector_t parent, const char *name,
+                    block_sector_t sector);
+void dcache_purge (block_sector_t parent);
+
+#endif /* filesys/dcache.h */
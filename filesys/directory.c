@@ -1,12 +1,60 @@
 #include "filesys/directory.h"
+#include <hash.h>
 #include <stdio.h>
 #include <string.h>
 #include <list.h>
+#include "filesys/dcache.h"
 #include "filesys/filesys.h"
+#include "filesys/free-map.h"
 #include "filesys/inode.h"
 #include "threads/malloc.h"
 #include "threads/thread.h"
 
+/* Directories with more than this many entry slots get a hashed
+   index, so that lookup, dir_add and dir_remove do not scan
+   every entry. */
+#define DIR_INDEX_THRESHOLD 64
+
+/* Fewest buckets a new index starts with. */
+#define DIR_INDEX_MIN_BUCKETS 4
+
+/* Identifies a directory index. */
+#define DIR_INDEX_MAGIC 0x44494458
+
+/* Index entries per bucket, and free slots remembered by the
+   index header. */
+#define DIR_BUCKET_ENTRIES 63
+#define DIR_FREE_SLOTS 125
+
+/* First sector of a directory index inode.
+   Must be exactly BLOCK_SECTOR_SIZE bytes long.
+   The index is stored in its own inode, referenced by the
+   directory's inode.  The header is followed by BUCKET_CNT
+   bucket sectors. */
+struct dir_index_header
+  {
+    unsigned magic;                     /* DIR_INDEX_MAGIC. */
+    uint32_t bucket_cnt;                /* Number of buckets. */
+    uint32_t free_cnt;                  /* Number of FREE_SLOTS in use. */
+    uint32_t free_slots[DIR_FREE_SLOTS]; /* Free directory slots. */
+  };
+
+/* One bucket of a directory index.
+   Must be exactly BLOCK_SECTOR_SIZE bytes long. */
+struct dir_bucket
+  {
+    uint32_t cnt;                       /* Number of ENTRIES in use. */
+    struct
+      {
+        uint32_t hash;                  /* hash_string() of the name. */
+        uint32_t slot;                  /* Entry's slot in directory. */
+      }
+    entries[DIR_BUCKET_ENTRIES];
+    uint32_t unused;                    /* Not used. */
+  };
+
+static bool index_build (struct dir *, size_t bucket_cnt);
+
 /* Creates a directory with space for ENTRY_CNT entries in the
    given SECTOR.  Returns true if successful, false on failure. */
 bool
@@ -111,6 +159,191 @@ dir_get_inode (struct dir *dir)
   return dir->inode;
 }
 
+/* Opens DIR's index, storing its header into *HEADER.
+   Returns a null pointer if DIR has no index. */
+static struct inode *
+index_open (const struct dir *dir, struct dir_index_header *header)
+{
+  block_sector_t sector = inode_get_index (dir->inode);
+  struct inode *index;
+
+  if (sector == 0)
+    return NULL;
+  index = inode_open (sector);
+  if (index != NULL
+      && (inode_read_at (index, header, sizeof *header, 0) != sizeof *header
+          || header->magic != DIR_INDEX_MAGIC))
+    {
+      inode_close (index);
+      return NULL;
+    }
+  return index;
+}
+
+/* Returns the offset within INDEX of the bucket for HASH. */
+static off_t
+bucket_ofs (const struct dir_index_header *header, unsigned hash)
+{
+  return (1 + hash % header->bucket_cnt) * BLOCK_SECTOR_SIZE;
+}
+
+/* Adds directory slot SLOT, whose name hashes to HASH, to INDEX.
+   Returns false if its bucket is full or on disk error. */
+static bool
+index_insert (struct inode *index, const struct dir_index_header *header,
+              unsigned hash, uint32_t slot)
+{
+  struct dir_bucket b;
+  off_t ofs = bucket_ofs (header, hash);
+
+  if (inode_read_at (index, &b, sizeof b, ofs) != sizeof b
+      || b.cnt >= DIR_BUCKET_ENTRIES)
+    return false;
+  b.entries[b.cnt].hash = hash;
+  b.entries[b.cnt].slot = slot;
+  b.cnt++;
+  return inode_write_at (index, &b, sizeof b, ofs) == sizeof b;
+}
+
+/* Removes directory slot SLOT, whose name hashes to HASH, from
+   INDEX. */
+static void
+index_delete (struct inode *index, const struct dir_index_header *header,
+              unsigned hash, uint32_t slot)
+{
+  struct dir_bucket b;
+  off_t ofs = bucket_ofs (header, hash);
+  uint32_t i;
+
+  if (inode_read_at (index, &b, sizeof b, ofs) != sizeof b)
+    return;
+  for (i = 0; i < b.cnt; i++)
+    if (b.entries[i].slot == slot)
+      {
+        b.entries[i] = b.entries[--b.cnt];
+        inode_write_at (index, &b, sizeof b, ofs);
+        return;
+      }
+}
+
+/* Searches the bucket of INDEX for NAME, which hashes to HASH,
+   reading candidate entries from DIR.  Same interface as
+   lookup(). */
+static bool
+index_lookup (const struct dir *dir, struct inode *index,
+              const struct dir_index_header *header,
+              const char *name, unsigned hash,
+              struct dir_entry *ep, off_t *ofsp)
+{
+  struct dir_bucket b;
+  struct dir_entry e;
+  uint32_t i;
+
+  if (inode_read_at (index, &b, sizeof b, bucket_ofs (header, hash))
+      != sizeof b)
+    return false;
+  for (i = 0; i < b.cnt; i++)
+    {
+      off_t ofs = b.entries[i].slot * sizeof e;
+      if (b.entries[i].hash == hash
+          && inode_read_at (dir->inode, &e, sizeof e, ofs) == sizeof e
+          && e.in_use && !strcmp (name, e.name))
+        {
+          if (ep != NULL)
+            *ep = e;
+          if (ofsp != NULL)
+            *ofsp = ofs;
+          return true;
+        }
+    }
+  return false;
+}
+
+/* Builds a new index with BUCKET_CNT buckets for DIR from its
+   entries and makes it replace DIR's current index, if any.
+   Doubles BUCKET_CNT until every bucket has room.
+   Returns false on disk or memory error, leaving DIR's current
+   index in place. */
+static bool
+index_build (struct dir *dir, size_t bucket_cnt)
+{
+  struct dir_index_header *header;
+  struct dir_entry e;
+  block_sector_t sector = 0;
+  struct inode *index = NULL;
+  bool success = false;
+
+  ASSERT (sizeof *header == BLOCK_SECTOR_SIZE);
+  ASSERT (sizeof (struct dir_bucket) == BLOCK_SECTOR_SIZE);
+  header = malloc (sizeof *header);
+  if (header == NULL)
+    return false;
+
+  for (;;)
+    {
+      off_t ofs;
+
+      if (!free_map_allocate (inode_get_inumber (dir->inode), 1, &sector))
+        break;
+      if (!inode_create (sector, (1 + bucket_cnt) * BLOCK_SECTOR_SIZE, DATA))
+        {
+          free_map_release (sector, 1);
+          break;
+        }
+      index = inode_open (sector);
+      if (index == NULL)
+        break;
+
+      memset (header, 0, sizeof *header);
+      header->magic = DIR_INDEX_MAGIC;
+      header->bucket_cnt = bucket_cnt;
+
+      /* Index every entry but "." and "..", collecting free slots
+         along the way. */
+      success = true;
+      for (ofs = 2 * sizeof e;
+           inode_read_at (dir->inode, &e, sizeof e, ofs) == sizeof e;
+           ofs += sizeof e)
+        {
+          uint32_t slot = ofs / sizeof e;
+          if (e.in_use)
+            success = index_insert (index, header, hash_string (e.name), slot);
+          else if (header->free_cnt < DIR_FREE_SLOTS)
+            header->free_slots[header->free_cnt++] = slot;
+          if (!success)
+            break;
+        }
+      if (success)
+        break;
+
+      /* A bucket overflowed.  Try again with twice as many. */
+      inode_remove (index);
+      inode_close (index);
+      index = NULL;
+      bucket_cnt *= 2;
+    }
+
+  if (success)
+    success = (inode_write_at (index, header, sizeof *header, 0)
+               == sizeof *header);
+  if (success)
+    {
+      struct dir_index_header old_header;
+      struct inode *old = index_open (dir, &old_header);
+      if (old != NULL)
+        {
+          inode_remove (old);
+          inode_close (old);
+        }
+      inode_set_index (dir->inode, sector);
+    }
+  else if (index != NULL)
+    inode_remove (index);
+  inode_close (index);
+  free (header);
+  return success;
+}
+
 /* Searches DIR for a file with the given NAME.
    If successful, returns true, sets *EP to the directory entry
    if EP is non-null, and sets *OFSP to the byte offset of the
@@ -120,12 +353,23 @@ static bool
 lookup (const struct dir *dir, const char *name,
         struct dir_entry *ep, off_t *ofsp)
 {
+  struct dir_index_header header;
+  struct inode *index;
   struct dir_entry e;
   size_t ofs;
 
   ASSERT (dir != NULL);
   ASSERT (name != NULL);
 
+  index = index_open (dir, &header);
+  if (index != NULL)
+    {
+      bool found = index_lookup (dir, index, &header, name,
+                                 hash_string (name), ep, ofsp);
+      inode_close (index);
+      return found;
+    }
+
   for (ofs = 0; inode_read_at (dir->inode, &e, sizeof e, ofs) == sizeof e;
        ofs += sizeof e)
     if (e.in_use && !strcmp (name, e.name))
@@ -147,13 +391,24 @@ bool
 dir_lookup (const struct dir *dir, const char *name,
             struct inode **inode)
 {
+  block_sector_t parent, sector;
   struct dir_entry e;
+  unsigned gen;
 
   ASSERT (dir != NULL);
   ASSERT (name != NULL);
 
-  if (lookup (dir, name, &e, NULL))
-    *inode = inode_open (e.inode_sector);
+  parent = inode_get_inumber (dir->inode);
+  if (!dcache_lookup (parent, name, &sector, &gen))
+    {
+      rwlock_acquire_read (&dir->inode->dir_lock);
+      sector = lookup (dir, name, &e, NULL) ? e.inode_sector : DCACHE_NEGATIVE;
+      rwlock_release_read (&dir->inode->dir_lock);
+      dcache_fill (parent, name, sector, gen);
+    }
+
+  if (sector != DCACHE_NEGATIVE)
+    *inode = inode_open (sector);
   else
     *inode = NULL;
 
@@ -169,8 +424,11 @@ dir_lookup (const struct dir *dir, const char *name,
 bool
 dir_add (struct dir *dir, const char *name, block_sector_t inode_sector, enum inode_type type)
 {
+  struct dir_index_header header;
+  struct inode *index;
   struct dir_entry e;
   off_t ofs;
+  bool reused = false;                  /* OFS came from free_slots? */
   bool success = false;
 
   ASSERT (dir != NULL);
@@ -180,6 +438,12 @@ dir_add (struct dir *dir, const char *name, block_sector_t inode_sector, enum in
   if (*name == '\0' || strlen (name) > NAME_MAX)
     return false;
 
+  /* Entries of one directory change one at a time, and never
+     once it has been removed. */
+  rwlock_acquire_write (&dir->inode->dir_lock);
+  if (dir->inode->removed)
+    goto done;
+
   /* Check that NAME is not in use. */
   if (lookup (dir, name, NULL, NULL))
     goto done;
@@ -192,8 +456,9 @@ dir_add (struct dir *dir, const char *name, block_sector_t inode_sector, enum in
     c.in_use       = true;
     // scuffed name
     c.name[0] = '.'; c.name[1] = '.'; c.name[2] = '\0';
-    if(inode_write_at (inode, &c, sizeof e, sizeof e) != sizeof e) {
-      return false;
+    if(inode == NULL || inode_write_at (inode, &c, sizeof e, sizeof e) != sizeof e) {
+      inode_close(inode);
+      goto done;
     }
     inode_close(inode);
   }
@@ -202,41 +467,109 @@ dir_add (struct dir *dir, const char *name, block_sector_t inode_sector, enum in
   /* Set OFS to offset of free slot.
      If there are no free slots, then it will be set to the
      current end-of-file.
+     An indexed directory takes a slot remembered by its index,
+     or else appends.  The slot stays on the index's free list
+     until the index holds the new entry, so that it is not lost
+     if that fails.
 
      inode_read_at() will only return a short read at end of file.
      Otherwise, we'd need to verify that we didn't get a short
      read due to something intermittent such as low memory. */
-  for (ofs = 0; inode_read_at (dir->inode, &e, sizeof e, ofs) == sizeof e;
-       ofs += sizeof e)
-    if (!e.in_use)
-      break;
+  index = index_open (dir, &header);
+  if (index != NULL)
+    {
+      if (header.free_cnt > 0)
+        {
+          ofs = header.free_slots[header.free_cnt - 1] * sizeof e;
+          reused = true;
+        }
+      else
+        ofs = inode_length (dir->inode) / sizeof e * sizeof e;
+    }
+  else
+    for (ofs = 0; inode_read_at (dir->inode, &e, sizeof e, ofs) == sizeof e;
+         ofs += sizeof e)
+      if (!e.in_use)
+        break;
 
   /* Write slot. */
   e.in_use = true;
   strlcpy (e.name, name, sizeof e.name);
   e.inode_sector = inode_sector;
   success = inode_write_at (dir->inode, &e, sizeof e, ofs) == sizeof e;
+  if (success)
+    dcache_update (inode_get_inumber (dir->inode), name, inode_sector);
+
+  /* Keep the index up to date, rebuilding it larger if the
+     entry's bucket is full, or build one once the directory is
+     big enough. */
+  if (success && index != NULL)
+    {
+      if (index_insert (index, &header, hash_string (name), ofs / sizeof e))
+        {
+          if (reused)
+            {
+              header.free_cnt--;
+              inode_write_at (index, &header, sizeof header, 0);
+            }
+        }
+      else if (!index_build (dir, header.bucket_cnt * 2))
+        {
+          /* An entry missing from the index could never be found. */
+          e.in_use = false;
+          inode_write_at (dir->inode, &e, sizeof e, ofs);
+          dcache_update (inode_get_inumber (dir->inode), name,
+                         DCACHE_NEGATIVE);
+          success = false;
+        }
+    }
+  else if (success
+           && inode_length (dir->inode) / sizeof e > DIR_INDEX_THRESHOLD)
+    index_build (dir, DIR_INDEX_MIN_BUCKETS);
+  inode_close (index);
 
  done:
+  rwlock_release_write (&dir->inode->dir_lock);
   return success;
 }
 
+/* Returns true if directory INODE holds no entries besides "."
+   and "..".  The caller must hold INODE's dir_lock. */
+static bool
+is_empty (struct inode *inode)
+{
+  struct dir_entry e;
+  off_t ofs;
+
+  for (ofs = 2 * sizeof e; inode_read_at (inode, &e, sizeof e, ofs) == sizeof e;
+       ofs += sizeof e)
+    if (e.in_use)
+      return false;
+  return true;
+}
+
 /* Removes any entry for NAME in DIR.
-   Returns true if successful, false on failure,
-   which occurs only if there is no file with the given NAME. */
+   Returns true if successful, false on failure, which occurs if
+   there is no file with the given NAME or it is a directory that
+   is not empty. */
 bool
 dir_remove (struct dir *dir, const char *name)
 {
+  struct dir_index_header header;
+  struct inode *index;
   struct dir_entry e;
   struct inode *inode = NULL;
+  bool child_locked = false;
   bool success = false;
   off_t ofs;
 
   ASSERT (dir != NULL);
   ASSERT (name != NULL);
 
-  /* Find directory entry. */
-  if (!lookup (dir, name, &e, &ofs))
+  rwlock_acquire_write (&dir->inode->dir_lock);
+
+  /* Find directory entry.  "." and ".." are never removed. */
+  if (!lookup (dir, name, &e, &ofs) || ofs < (off_t) (2 * sizeof e))
     goto done;
 
   /* Open inode. */
@@ -244,16 +577,45 @@ dir_remove (struct dir *dir, const char *name)
   if (inode == NULL)
     goto done;
 
+  /* A directory must stay empty until it is marked removed, so
+     hold its own lock too.  Parents are always locked before
+     their children. */
+  if (inode->data.type == DIR)
+    {
+      rwlock_acquire_write (&inode->dir_lock);
+      child_locked = true;
+      if (!is_empty (inode))
+        goto done;
+    }
+
   /* Erase directory entry. */
   e.in_use = false;
   if (inode_write_at (dir->inode, &e, sizeof e, ofs) != sizeof e)
     goto done;
+  dcache_update (inode_get_inumber (dir->inode), name, DCACHE_NEGATIVE);
+  dcache_purge (e.inode_sector);
+
+  /* Drop it from the index and remember its slot for reuse. */
+  index = index_open (dir, &header);
+  if (index != NULL)
+    {
+      index_delete (index, &header, hash_string (name), ofs / sizeof e);
+      if (header.free_cnt < DIR_FREE_SLOTS)
+        {
+          header.free_slots[header.free_cnt++] = ofs / sizeof e;
+          inode_write_at (index, &header, sizeof header, 0);
+        }
+      inode_close (index);
+    }
 
   /* Remove inode. */
   inode_remove (inode);
   success = true;
 
  done:
+  if (child_locked)
+    rwlock_release_write (&inode->dir_lock);
+  rwlock_release_write (&dir->inode->dir_lock);
   inode_close (inode);
   return success;
 }
@@ -274,28 +636,26 @@ dir_readdir (struct dir *dir, char name[NAME_MAX + 1])
     dir->pos = 2 * sizeof(e);
   }
 
+  rwlock_acquire_read (&dir->inode->dir_lock);
   while (inode_read_at (dir->inode, &e, sizeof e, dir->pos) == sizeof e) {
     dir->pos += sizeof e;
     if (e.in_use) {
       strlcpy (name, e.name, NAME_MAX + 1);
+      rwlock_release_read (&dir->inode->dir_lock);
       return true;
     }
   }
+  rwlock_release_read (&dir->inode->dir_lock);
   return false;
 }
 
 bool dir_isEmpty(struct dir* dir) {
-  struct dir_entry e;
-  size_t ofs;
+  bool empty;
 
   ASSERT (dir != NULL);
 
-  for (ofs = 2*sizeof e; inode_read_at (dir->inode, &e, sizeof e, ofs) == sizeof e;
-       ofs += sizeof e) {
-    if (e.in_use)
-      {
-        return false;
-      }
-  }
-  return true;
+  rwlock_acquire_read (&dir->inode->dir_lock);
+  empty = is_empty (dir->inode);
+  rwlock_release_read (&dir->inode->dir_lock);
+  return empty;
 }
@@ -3,6 +3,12 @@
 #include "filesys/inode.h"
 #include "threads/malloc.h"
 
+/* Bounds on the read-ahead window of a sequential reader. */
+#define READAHEAD_MIN (2 * BLOCK_SECTOR_SIZE)
+#define READAHEAD_MAX (32 * BLOCK_SECTOR_SIZE)
+
+static void file_readahead (struct file *, off_t start);
+
 /* Opens a file for the given INODE, of which it takes ownership,
    and returns the new file.  Returns a null pointer if an
    allocation fails or if INODE is null. */
@@ -15,6 +21,9 @@ file_open (struct inode *inode)
       file->inode = inode;
       file->pos = 0;
       file->deny_write = false;
+      file->ra_next = 0;
+      file->ra_window = 0;
+      file->ra_end = 0;
       return file;
     }
   else
@@ -56,15 +65,73 @@ file_get_inode (struct file *file)
    starting at the file's current position.
    Returns the number of bytes actually read,
    which may be less than SIZE if end of file is reached.
-   Advances FILE's position by the number of bytes read. */
+   Advances FILE's position by the number of bytes read.
+   A run of reads that each start where the previous one ended
+   also starts read-ahead of the data that follows. */
 off_t
 file_read (struct file *file, void *buffer, off_t size)
 {
+  off_t start = file->pos;
   off_t bytes_read = inode_read_at (file->inode, buffer, size, file->pos);
   file->pos += bytes_read;
+  file_readahead (file, start);
+  return bytes_read;
+}
+
+/* Reads from FILE, starting at the file's current position, into
+   the CNT buffers described by IOV in turn.
+   Returns the number of bytes actually read,
+   which may be less than the buffers' total size if end of file
+   is reached.
+   Advances FILE's position by the number of bytes read. */
+off_t
+file_readv (struct file *file, const struct iovec *iov, int cnt)
+{
+  off_t start = file->pos;
+  off_t bytes_read = inode_readv_at (file->inode, iov, cnt, file->pos);
+  file->pos += bytes_read;
+  file_readahead (file, start);
   return bytes_read;
 }
 
+/* Updates FILE's read-ahead window after a read that started at
+   START and ended at FILE's current position, and queues any
+   newly covered sectors for reading in the background.
+
+   The window doubles on every sequential read, up to
+   READAHEAD_MAX, and halves on every read elsewhere, so that
+   random access stops paying for read-ahead it does not use. */
+static void
+file_readahead (struct file *file, off_t start)
+{
+  if (start == file->ra_next)
+    {
+      file->ra_window *= 2;
+      if (file->ra_window < READAHEAD_MIN)
+        file->ra_window = READAHEAD_MIN;
+      else if (file->ra_window > READAHEAD_MAX)
+        file->ra_window = READAHEAD_MAX;
+    }
+  else
+    {
+      file->ra_window /= 2;
+      file->ra_end = 0;
+    }
+  file->ra_next = file->pos;
+
+  if (file->ra_window >= READAHEAD_MIN)
+    {
+      off_t end = file->pos + file->ra_window;
+      if (file->ra_end < file->pos)
+        file->ra_end = file->pos;
+      if (file->ra_end < end)
+        {
+          inode_readahead (file->inode, file->ra_end, end);
+          file->ra_end = end;
+        }
+    }
+}
+
 /* Reads SIZE bytes from FILE into BUFFER,
    starting at offset FILE_OFS in the file.
    Returns the number of bytes actually read,
@@ -91,6 +158,20 @@ file_write (struct file *file, const void *buffer, off_t size)
   return bytes_written;
 }
 
+/* Writes the CNT buffers described by IOV in turn into FILE,
+   starting at the file's current position.
+   Returns the number of bytes actually written,
+   which may be less than the buffers' total size if the disk
+   fills up.
+   Advances FILE's position by the number of bytes written. */
+off_t
+file_writev (struct file *file, const struct iovec *iov, int cnt)
+{
+  off_t bytes_written = inode_writev_at (file->inode, iov, cnt, file->pos);
+  file->pos += bytes_written;
+  return bytes_written;
+}
+
 /* Writes SIZE bytes from BUFFER into FILE,
    starting at offset FILE_OFS in the file.
    Returns the number of bytes actually written,
@@ -105,6 +186,30 @@ file_write_at (struct file *file, const void *buffer, off_t size,
   return inode_write_at (file->inode, buffer, size, file_ofs);
 }
 
+/* Copies SIZE bytes of IN starting at offset IN_OFS into OUT
+   starting at offset OUT_OFS, inside the file system.
+   Returns the number of bytes actually copied, which may be less
+   than SIZE if end of IN is reached or the disk fills up, or -1
+   if IN and OUT are the same file and the ranges overlap.
+   Neither file's current position is affected. */
+off_t
+file_copy_range (struct file *in, off_t in_ofs, struct file *out,
+                 off_t out_ofs, off_t size)
+{
+  return inode_copy_range (in->inode, in_ofs, out->inode, out_ofs, size);
+}
+
+/* Sets the length of FILE to LENGTH bytes, discarding data past
+   LENGTH or extending FILE with zeros.  The file position is not
+   changed.  Returns false if writes to FILE are denied or LENGTH
+   is too large. */
+bool
+file_truncate (struct file *file, off_t length)
+{
+  ASSERT (file != NULL);
+  return inode_truncate (file->inode, length);
+}
+
 /* Prevents write operations on FILE's underlying inode
    until file_allow_write() is called or FILE is closed. */
 void
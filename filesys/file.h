@@ -10,6 +10,11 @@ struct file
     struct inode *inode;        /* File's inode. */
     off_t pos;                  /* Current position. */
     bool deny_write;            /* Has file_deny_write() been called? */
+
+    /* Sequential read-ahead state, see file_read(). */
+    off_t ra_next;              /* Where a sequential reader reads next. */
+    off_t ra_window;            /* Bytes to keep read ahead of POS. */
+    off_t ra_end;               /* End of region already read ahead. */
   };
 
 /* Opening and closing files. */
@@ -23,6 +28,11 @@ off_t file_read (struct file *, void *, off_t);
 off_t file_read_at (struct file *, void *, off_t size, off_t start);
 off_t file_write (struct file *, const void *, off_t);
 off_t file_write_at (struct file *, const void *, off_t size, off_t start);
+off_t file_readv (struct file *, const struct iovec *, int cnt);
+off_t file_writev (struct file *, const struct iovec *, int cnt);
+off_t file_copy_range (struct file *in, off_t in_ofs, struct file *out,
+                       off_t out_ofs, off_t size);
+bool file_truncate (struct file *, off_t length);
 
 /* Preventing writes. */
 void file_deny_write (struct file *);
@@ -3,14 +3,21 @@
 #include <stdio.h>
 #include <string.h>
 #include "threads/thread.h"
+#include "filesys/cache.h"
+#include "filesys/dcache.h"
 #include "filesys/file.h"
 #include "filesys/free-map.h"
 #include "filesys/inode.h"
+#include "filesys/journal.h"
+#include "filesys/refcount.h"
 #include "filesys/directory.h"
 
 /* Partition that contains the file system. */
 struct block *fs_device;
 
+/* Inode format used when formatting. */
+static enum inode_format format_type = INODE_INDEXED;
+
 static void do_format (void);
 static bool validName(const char*);
 struct dir* walkPath(const char *name, const struct dir* pwd, char* final_name, bool*, bool*);
@@ -24,13 +31,32 @@ filesys_init (bool format)
   if (fs_device == NULL)
     PANIC ("No file system device found, can't initialize file system.");
 
+  cache_init ();
   inode_init ();
+  dcache_init ();
   free_map_init ();
+  journal_init ();
+  refcount_init ();
 
   if (format)
     do_format ();
+  else
+    {
+      journal_recover ();
+      inode_inherit_format (FREE_MAP_SECTOR);
+    }
 
   free_map_open ();
+  refcount_open ();
+}
+
+/* Selects the inode format that formatting the file system will
+   use.  Has no effect on an existing file system, whose format is
+   kept. */
+void
+filesys_set_format (enum inode_format format)
+{
+  format_type = format;
 }
 
 /* Shuts down the file system module, writing any unwritten data
@@ -38,7 +64,20 @@ filesys_init (bool format)
 void
 filesys_done (void)
 {
+  inode_reclaim_wait ();
+  refcount_close ();
   free_map_close ();
+  journal_close ();
+  cache_flush ();
+}
+
+/* Writes all file system data buffered in memory to disk,
+   committing the journal first. */
+void
+filesys_sync (void)
+{
+  journal_commit ();
+  cache_flush ();
 }
 
 /* Creates a file named NAME with the given INITIAL_SIZE.
@@ -54,15 +93,61 @@ filesys_create (const char *name, off_t initial_size)
   block_sector_t inode_sector = 0;
   char final_name[NAME_MAX+1];
   bool isExist;
+  journal_begin ();
   struct dir *dir = walkPath(name, thread_current()->pwd, final_name, &isExist, NULL);
   bool success = (dir != NULL
 		  && !isExist
-                  && free_map_allocate (1, &inode_sector)
+                  && free_map_allocate (inode_get_inumber (dir_get_inode (dir)),
+                                        1, &inode_sector)
                   && inode_create (inode_sector, initial_size, FILE)
                   && dir_add (dir, final_name, inode_sector, FILE));
   if (!success && inode_sector != 0)
     free_map_release (inode_sector, 1);
   dir_close (dir);
+  journal_end ();
+
+  return success;
+}
+
+/* Creates a file named NAME with the same contents as SRC, which
+   must be a file.  The new file shares SRC's data sectors until
+   either file writes them, so this takes time in proportion to
+   SRC's metadata, not its size.
+   Returns true if successful, false if a file named NAME already
+   exists, memory, disk space, or references run out, or the file
+   system has no reference count file to track sharing. */
+bool
+filesys_clone (const char *name, struct inode *src)
+{
+  if(!validName(name) || !refcount_enabled ()) {
+    return false;
+  }
+  block_sector_t inode_sector = 0;
+  char final_name[NAME_MAX+1];
+  bool isExist;
+  journal_begin ();
+  struct dir *dir = walkPath(name, thread_current()->pwd, final_name, &isExist, NULL);
+  bool success = (dir != NULL
+		  && !isExist
+                  && free_map_allocate (inode_get_inumber (dir_get_inode (dir)),
+                                        1, &inode_sector)
+                  && inode_clone (src, inode_sector));
+  if (success && !dir_add (dir, final_name, inode_sector, FILE))
+    {
+      /* Drop the clone's references along with the inode. */
+      struct inode *inode = inode_open (inode_sector);
+      if (inode != NULL)
+        {
+          inode_remove (inode);
+          inode_close (inode);
+          inode_sector = 0;
+        }
+      success = false;
+    }
+  if (!success && inode_sector != 0)
+    free_map_release (inode_sector, 1);
+  dir_close (dir);
+  journal_end ();
 
   return success;
 }
@@ -162,9 +247,12 @@ filesys_remove (const char *name)
   bool isFile;
   bool success;
   struct inode *temp = NULL;
+  journal_begin ();
   struct dir *dir = walkPath(name, thread_current()->pwd, final_name, &isExist, &isFile);
   struct dir *prtDir = NULL;
-  if(dir->inode->removed) {
+  if(dir == NULL || dir->inode->removed) {
+    dir_close (dir);
+    journal_end ();
     return false;
   }
   if(!dir_lookup(dir, final_name, &temp)) {
@@ -185,6 +273,7 @@ filesys_remove (const char *name)
   dir_close (dir);
   dir_close (prtDir);
   inode_close (temp);
+  journal_end ();
   return success;
 }
 
@@ -193,36 +282,73 @@ static void
 do_format (void)
 {
   printf ("Formatting file system...");
+  journal_create ();
+  inode_set_format (format_type);
   free_map_create ();
+  refcount_create ();
   if (!dir_create (ROOT_DIR_SECTOR, 16))
     PANIC ("root directory creation failed");
   free_map_close ();
   printf ("done.\n");
 }
 
+/* Extracts the next file name component from *SRCP into PART
+   and advances *SRCP past it.
+   Returns 1 if successful, 0 at end of string, or -1 if the
+   component is longer than NAME_MAX. */
+static int
+get_next_part (char part[NAME_MAX + 1], const char **srcp)
+{
+  const char *src = *srcp;
+  char *dst = part;
+
+  /* Skip leading slashes.  If it's all slashes, we're done. */
+  while (*src == '/')
+    src++;
+  if (*src == '\0')
+    return 0;
+
+  /* Copy up to NAME_MAX character from SRC to DST.  Add null
+     terminator. */
+  while (*src != '/' && *src != '\0')
+    {
+      if (dst < part + NAME_MAX)
+        *dst++ = *src;
+      else
+        return -1;
+      src++;
+    }
+  *dst = '\0';
+
+  /* Advance source pointer. */
+  *srcp = src;
+  return 1;
+}
+
 // walks a path and then returns a dir
-// pointing to the last dir in that path
+// pointing to the last dir in that path.
+// components are split off in place, and a component
+// longer than NAME_MAX makes the whole path invalid
 struct dir* walkPath(const char *name, const struct dir* pwd, char* final_name, bool* lastExist, bool* isFile) {
-  char* currentToken = NULL;
-  char* saveptr      = NULL;
-  char* tempBuf      = malloc(sizeof(char) * (strlen(name) + 1));
-  memcpy(tempBuf, name, sizeof(char) * (strlen(name) +1));
+  char currentToken[NAME_MAX + 1];
+  const char* rest = name;
+  int status;
   struct dir* curDir = NULL;
   struct dir* tempDir = NULL;
   struct inode* temp = NULL;
   bool notExist = false;
   bool fileOnPath = false;
-  bool usingPWD   = false;
   if (name[0] == '/' || pwd == NULL) {
     curDir = dir_open_root();
   }
   else {
-    usingPWD = true;
-    curDir = dir_reopen(pwd);
+    curDir = dir_reopen((struct dir *) pwd);
+  }
+  if(final_name != NULL) {
+    *final_name = '\0';
   }
   
-  for (currentToken = strtok_r (tempBuf, "/", &saveptr); currentToken != NULL;
-       currentToken = strtok_r (NULL, "/", &saveptr)) {
+  while ((status = get_next_part (currentToken, &rest)) > 0) {
 
     // return the last token to the caller
     // since we cannot know the last one we
@@ -240,16 +366,7 @@ struct dir* walkPath(const char *name, const struct dir* pwd, char* final_name,
     // token doesnt exist on the path
     // return null and handle the error in the caller
     if(notExist || fileOnPath) {
-      if(final_name != NULL) {
-	*final_name = '\0';
-      }
-      free(tempBuf);
-      inode_close(temp);
-      if(lastExist) {
-	*lastExist = !notExist;
-      }
-      dir_close(curDir);
-      return NULL;
+      break;
     }
     
     if(strcmp(currentToken, ".") == 0) {
@@ -280,13 +397,26 @@ struct dir* walkPath(const char *name, const struct dir* pwd, char* final_name,
 	  dir_close(curDir);
 	  curDir = dir_open( temp );
 	}
+	temp = NULL;
       }
     }
   }
 
+  if (status != 0) {
+    // an inner component was missing or a file, or a
+    // component was too long
+    if(final_name != NULL) {
+      *final_name = '\0';
+    }
+    if(lastExist) {
+      *lastExist = !notExist && status > 0;
+    }
+    dir_close(curDir);
+    return NULL;
+  }
+
   // we didnt exit prematurely due to something not existing on
   // the path
-  free(tempBuf);
   if(lastExist) {
     *lastExist = !notExist;
   }
@@ -312,35 +442,23 @@ bool filesys_create_dir (const char *name, const struct dir* parent) {
   }
   block_sector_t inode_sector = 0;
   char final_name[NAME_MAX+1]; // name at the end of tokenization
+  journal_begin ();
   struct dir* final_parent = walkPath(name, parent, final_name, NULL, NULL);
   bool success = (final_parent != NULL
-                  && free_map_allocate (1, &inode_sector)
+                  && free_map_allocate (inode_get_inumber (dir_get_inode (final_parent)),
+                                        1, &inode_sector)
                   && dir_create (inode_sector, 16)
                   && dir_add (final_parent, final_name, inode_sector, DIR));
   if (!success && inode_sector != 0)
     free_map_release (inode_sector, 1);
   
   dir_close(final_parent);
+  journal_end ();
   return success;
 }
 
+/* Returns true if NAME can name a file.  Components longer than
+   NAME_MAX are rejected by walkPath() as it splits them off. */
 static bool validName(const char* name) {
-  if(*name == '\0') {
-    return false;
-  }
-    
-  char *currentToken = NULL;
-  char *saveptr      = NULL;
-  char *tempBuf      = malloc(sizeof(char) * (strlen(name) + 1));
-  memcpy(tempBuf, name, (strlen(name) + 1) * sizeof(char));
-  
-  for (currentToken = strtok_r (tempBuf, "/", &saveptr); currentToken != NULL;
-       currentToken = strtok_r (NULL, "/", &saveptr)) {
-    if(strlen(currentToken) > NAME_MAX) {
-      free(tempBuf);
-      return false;
-    }
-  }
-  free(tempBuf);
-  return true;
+  return *name != '\0';
 }
@@ -8,13 +8,19 @@
 /* Sectors of system file inodes. */
 #define FREE_MAP_SECTOR 0       /* Free map file inode sector. */
 #define ROOT_DIR_SECTOR 1       /* Root directory file inode sector. */
+#define JOURNAL_SECTOR 2        /* First sector of the journal. */
+#define REFCOUNT_SECTOR 130     /* Reference count file inode sector,
+                                   just past the journal. */
 
 /* Block device that contains the file system. */
 struct block *fs_device;
 
 void filesys_init (bool format);
+void filesys_set_format (enum inode_format);
 void filesys_done (void);
+void filesys_sync (void);
 bool filesys_create (const char *name, off_t initial_size);
+bool filesys_clone (const char *name, struct inode *src);
 bool filesys_create_dir (const char *name, const struct dir* parent);
 struct file *filesys_open (const char *name);
 struct dir* filesys_open_dir(const char *name);
@@ -1,70 +1,319 @@
 #include "filesys/free-map.h"
 #include <bitmap.h>
 #include <debug.h>
+#include <round.h>
+#include <stdint.h>
+#include "threads/malloc.h"
 #include "filesys/file.h"
 #include "filesys/filesys.h"
 #include "filesys/inode.h"
+#include "filesys/journal.h"
+#include "threads/synch.h"
+
+/* Free map bits stored in one sector of the free map file. */
+#define BITS_PER_SECTOR (BLOCK_SECTOR_SIZE * 8)
+
+/* The disk is divided into block groups of GROUP_SECTORS sectors,
+   whose bits fill exactly one sector of the free map file.  The
+   division follows from the size of the device, so it is fixed
+   when the disk is formatted and needs no space on disk.  Each
+   group has its own lock and free space index, so allocations in
+   different groups do not contend, and callers name a sector to
+   allocate near so that related sectors share a group. */
+#define GROUP_SECTORS BITS_PER_SECTOR
+
+/* Sectors summarized by each leaf of a free space index. */
+#define LEAF_SECTORS 256
+#define LEAF_CNT (GROUP_SECTORS / LEAF_SECTORS)
+
+/* Requests of at least this many sectors are placed by best fit,
+   smaller ones by next fit. */
+#define LARGE_REQUEST 64
+
+/* A free space index is a complete binary tree over the free map
+   bits of one group, stored as an array with the root at index 1
+   and the children of node I at 2*I and 2*I+1.  Leaf J summarizes
+   the group's sectors J*LEAF_SECTORS up to (J+1)*LEAF_SECTORS;
+   sectors past the end of the device count as in use.  Each node
+   records the free runs of its range, which is enough to find a
+   run of any length by descending from the root in O(log n)
+   steps.
+
+   The bitmap remains the authority and the only thing written to
+   the free map file; the indexes are rebuilt from it on open.
+   They also count as in use the sectors the journal holds back
+   (see free_map_release()). */
+struct free_node
+  {
+    uint32_t longest;           /* Longest free run in the range. */
+    uint32_t prefix;            /* Free sectors at start of range. */
+    uint32_t suffix;            /* Free sectors at end of range. */
+  };
+
+/* A block group. */
+struct block_group
+  {
+    struct lock lock;           /* Protects the group's bits and the
+                                   members below. */
+    block_sector_t start;       /* First sector of the group. */
+    block_sector_t next_fit;    /* Where small requests start. */
+    bool dirty;                 /* Free map file sector needs writing? */
+    struct free_node index[2 * LEAF_CNT]; /* Index, [1] is the root. */
+  };
 
 static struct file *free_map_file;   /* Free map file. */
 static struct bitmap *free_map;      /* Free map, one bit per sector. */
+static struct bitmap *held;          /* Free but not to be allocated. */
+static struct block_group *groups;   /* Block groups. */
+static size_t group_cnt;             /* Number of block groups. */
+
+/* Protects free_map_file.  Acquire it before any group's lock. */
+static struct lock free_map_lock;
+
+static void group_build (struct block_group *);
+static void group_update (struct block_group *, block_sector_t, size_t);
+static void recompute (struct block_group *, size_t lo, size_t hi);
+static block_sector_t group_allocate (struct block_group *,
+                                      block_sector_t near, size_t cnt);
+
+/* Returns the block group that contains SECTOR. */
+static struct block_group *
+group_of (block_sector_t sector)
+{
+  ASSERT (sector < bitmap_size (free_map));
+  return &groups[sector / GROUP_SECTORS];
+}
+
+/* Returns true if SECTOR may be allocated.  Must be called with
+   the lock of SECTOR's group held. */
+static bool
+is_free (block_sector_t sector)
+{
+  return !bitmap_test (free_map, sector) && !bitmap_test (held, sector);
+}
+
+/* Returns the sector just past the end of block group G. */
+static block_sector_t
+group_end (const struct block_group *g)
+{
+  size_t end = g->start + GROUP_SECTORS;
+
+  return end < bitmap_size (free_map) ? end : bitmap_size (free_map);
+}
 
 /* Initializes the free map. */
 void
 free_map_init (void)
 {
+  size_t i;
+
   free_map = bitmap_create (block_size (fs_device));
-  if (free_map == NULL)
+  held = bitmap_create (block_size (fs_device));
+  if (free_map == NULL || held == NULL)
     PANIC ("bitmap creation failed--file system device is too large");
+  group_cnt = DIV_ROUND_UP (bitmap_size (free_map), GROUP_SECTORS);
+  groups = malloc (group_cnt * sizeof *groups);
+  if (groups == NULL)
+    PANIC ("block group creation failed--file system device is too large");
+  lock_init (&free_map_lock);
   bitmap_mark (free_map, FREE_MAP_SECTOR);
   bitmap_mark (free_map, ROOT_DIR_SECTOR);
+  bitmap_set_multiple (free_map, JOURNAL_SECTOR, JOURNAL_SECTORS, true);
+  ASSERT (REFCOUNT_SECTOR == JOURNAL_SECTOR + JOURNAL_SECTORS);
+  bitmap_mark (free_map, REFCOUNT_SECTOR);
+
+  for (i = 0; i < group_cnt; i++)
+    {
+      struct block_group *g = &groups[i];
+
+      lock_init (&g->lock);
+      g->start = i * GROUP_SECTORS;
+      g->next_fit = g->start;
+      g->dirty = false;
+      group_build (g);
+    }
 }
 
 /* Allocates CNT consecutive sectors from the free map and stores
-   the first into *SECTORP.
+   the first into *SECTORP.  The sectors come from the block group
+   that contains NEAR if it has room, starting the search at NEAR,
+   and otherwise from the following groups in turn.  Small requests
+   are placed by next fit so that successive allocations land next
+   to each other; large ones go to the tightest run that holds
+   them, leaving long runs for later large requests.  A run never
+   crosses a group boundary.
    Returns true if successful, false if not enough consecutive
-   sectors were available or if the free_map file could not be
-   written. */
+   sectors were available even after the reclamation thread
+   caught up, or if the caller could not wait for it to.  The
+   change reaches the free map file at the next free_map_flush(). */
 bool
-free_map_allocate (size_t cnt, block_sector_t *sectorp)
+free_map_allocate (block_sector_t near, size_t cnt, block_sector_t *sectorp)
 {
-  block_sector_t sector = bitmap_scan_and_flip (free_map, 0, cnt, false);
-  if (sector != BITMAP_ERROR
-      && free_map_file != NULL
-      && !bitmap_write (free_map, free_map_file))
+  block_sector_t sector = BITMAP_ERROR;
+  size_t first;
+
+  ASSERT (cnt > 0);
+  if (cnt > GROUP_SECTORS)
+    return false;
+
+  first = near < bitmap_size (free_map) ? near / GROUP_SECTORS : 0;
+  do
     {
-      bitmap_set_multiple (free_map, sector, cnt, false);
-      sector = BITMAP_ERROR;
+      size_t i;
+
+      for (i = 0; i < group_cnt && sector == BITMAP_ERROR; i++)
+        {
+          struct block_group *g = &groups[(first + i) % group_cnt];
+
+          lock_acquire (&g->lock);
+          sector = group_allocate (g, near, cnt);
+          lock_release (&g->lock);
+        }
     }
+  while (sector == BITMAP_ERROR && inode_reclaim_wait ());
+
   if (sector != BITMAP_ERROR)
     *sectorp = sector;
   return sector != BITMAP_ERROR;
 }
 
-/* Makes CNT sectors starting at SECTOR available for use. */
+/* Allocates up to CNT sectors starting exactly at SECTOR, stopping
+   at the first sector that is already in use.
+   Returns the number of sectors allocated, which is 0 if SECTOR
+   itself is in use. */
+size_t
+free_map_extend (block_sector_t sector, size_t cnt)
+{
+  size_t n = 0;
+
+  while (n < cnt && sector + n < bitmap_size (free_map))
+    {
+      struct block_group *g = group_of (sector + n);
+      block_sector_t end = group_end (g);
+      size_t m = 0;
+
+      lock_acquire (&g->lock);
+      while (n + m < cnt && sector + n + m < end
+             && is_free (sector + n + m))
+        m++;
+      if (m > 0)
+        {
+          bitmap_set_multiple (free_map, sector + n, m, true);
+          group_update (g, sector + n, m);
+        }
+      lock_release (&g->lock);
+
+      n += m;
+      if (sector + n < end)
+        break;
+    }
+  return n;
+}
+
+/* Makes CNT sectors starting at SECTOR available for use.  A
+   sector that recovery might still overwrite with an older copy
+   logged in the journal is freed in the free map file all the
+   same, but is not allocated again until the journal hands it
+   back through free_map_unhold(). */
 void
 free_map_release (block_sector_t sector, size_t cnt)
 {
-  ASSERT (bitmap_all (free_map, sector, cnt));
-  bitmap_set_multiple (free_map, sector, cnt, false);
-  bitmap_write (free_map, free_map_file);
+  while (cnt > 0)
+    {
+      struct block_group *g = group_of (sector);
+      size_t m = group_end (g) - sector;
+      size_t i;
+
+      if (m > cnt)
+        m = cnt;
+      lock_acquire (&g->lock);
+      ASSERT (bitmap_all (free_map, sector, m));
+      bitmap_set_multiple (free_map, sector, m, false);
+      for (i = 0; i < m; i++)
+        if (journal_hold (sector + i))
+          bitmap_mark (held, sector + i);
+      group_update (g, sector, m);
+      lock_release (&g->lock);
+
+      sector += m;
+      cnt -= m;
+    }
+}
+
+/* Lets SECTOR, which free_map_release() freed but held back for
+   the journal, be allocated again. */
+void
+free_map_unhold (block_sector_t sector)
+{
+  struct block_group *g = group_of (sector);
+  size_t leaf = LEAF_CNT + (sector - g->start) / LEAF_SECTORS;
+
+  lock_acquire (&g->lock);
+  ASSERT (bitmap_test (held, sector));
+  bitmap_reset (held, sector);
+  recompute (g, leaf, leaf);
+  lock_release (&g->lock);
+}
+
+/* Writes the sectors of the free map file whose groups have
+   changed since they were last written.  Does nothing if the free
+   map file is not open. */
+void
+free_map_flush (void)
+{
+  size_t i;
+
+  /* Begin before locking: a commit that holds off new operations
+     flushes the free map itself. */
+  journal_begin ();
+  lock_acquire (&free_map_lock);
+  if (free_map_file != NULL)
+    for (i = 0; i < group_cnt; i++)
+      {
+        struct block_group *g = &groups[i];
+
+        lock_acquire (&g->lock);
+        if (g->dirty)
+          {
+            if (!bitmap_write_range (free_map, free_map_file,
+                                     i * BLOCK_SECTOR_SIZE,
+                                     BLOCK_SECTOR_SIZE))
+              PANIC ("can't write free map");
+            g->dirty = false;
+          }
+        lock_release (&g->lock);
+      }
+  lock_release (&free_map_lock);
+  journal_end ();
 }
 
 /* Opens the free map file and reads it from disk. */
 void
 free_map_open (void)
 {
+  size_t i;
+
   free_map_file = file_open (inode_open (FREE_MAP_SECTOR));
   if (free_map_file == NULL)
     PANIC ("can't open free map");
   if (!bitmap_read (free_map, free_map_file))
     PANIC ("can't read free map");
+  for (i = 0; i < group_cnt; i++)
+    {
+      groups[i].dirty = false;
+      group_build (&groups[i]);
+    }
 }
 
 /* Writes the free map to disk and closes the free map file. */
 void
 free_map_close (void)
 {
+  free_map_flush ();
+  lock_acquire (&free_map_lock);
   file_close (free_map_file);
+  free_map_file = NULL;
+  lock_release (&free_map_lock);
 }
 
 /* Creates a new free map file on disk and writes the free map to
@@ -72,6 +321,8 @@ free_map_close (void)
 void
 free_map_create (void)
 {
+  size_t i;
+
   /* Create inode. */
   if (!inode_create (FREE_MAP_SECTOR, bitmap_file_size (free_map), FILE))
     PANIC ("free map creation failed");
@@ -82,4 +333,217 @@ free_map_create (void)
     PANIC ("can't open free map");
   if (!bitmap_write (free_map, free_map_file))
     PANIC ("can't write free map");
+  for (i = 0; i < group_cnt; i++)
+    groups[i].dirty = false;
+}
+
+/* Computes leaf node I of G's free space index from the bitmap. */
+static void
+compute_leaf (struct block_group *g, size_t i)
+{
+  struct free_node *n = &g->index[i];
+  block_sector_t first = g->start + (i - LEAF_CNT) * LEAF_SECTORS;
+  size_t run = 0;
+  size_t ofs;
+
+  n->longest = n->prefix = 0;
+  for (ofs = 0; ofs < LEAF_SECTORS; ofs++)
+    {
+      if (first + ofs < bitmap_size (free_map)
+          && is_free (first + ofs))
+        {
+          run++;
+          if (run > n->longest)
+            n->longest = run;
+        }
+      else
+        {
+          if (run == ofs)
+            n->prefix = run;
+          run = 0;
+        }
+    }
+  if (run == LEAF_SECTORS)
+    n->prefix = run;
+  n->suffix = run;
+}
+
+/* Computes interior node I of G's free space index from its
+   children, each of which covers HALF sectors. */
+static void
+combine (struct block_group *g, size_t i, size_t half)
+{
+  struct free_node *n = &g->index[i];
+  const struct free_node *l = &g->index[2 * i];
+  const struct free_node *r = &g->index[2 * i + 1];
+
+  n->prefix = l->prefix == half ? half + r->prefix : l->prefix;
+  n->suffix = r->suffix == half ? half + l->suffix : r->suffix;
+  n->longest = l->suffix + r->prefix;
+  if (l->longest > n->longest)
+    n->longest = l->longest;
+  if (r->longest > n->longest)
+    n->longest = r->longest;
+}
+
+/* Recomputes the nodes of G's free space index that cover leaves
+   LO through HI, inclusive, and all of their ancestors. */
+static void
+recompute (struct block_group *g, size_t lo, size_t hi)
+{
+  size_t half = LEAF_SECTORS;
+  size_t i;
+
+  for (i = lo; i <= hi; i++)
+    compute_leaf (g, i);
+  while (lo > 1)
+    {
+      lo /= 2;
+      hi /= 2;
+      for (i = lo; i <= hi; i++)
+        combine (g, i, half);
+      half *= 2;
+    }
+}
+
+/* Rebuilds G's free space index from the bitmap. */
+static void
+group_build (struct block_group *g)
+{
+  recompute (g, LEAF_CNT, 2 * LEAF_CNT - 1);
+  g->next_fit = g->start;
+}
+
+/* Updates G after CNT of its sectors starting at SECTOR changed
+   in the bitmap.  Must be called with G's lock held. */
+static void
+group_update (struct block_group *g, block_sector_t sector, size_t cnt)
+{
+  ASSERT (cnt > 0);
+  ASSERT (sector >= g->start && sector + cnt <= group_end (g));
+  recompute (g, LEAF_CNT + (sector - g->start) / LEAF_SECTORS,
+             LEAF_CNT + (sector + cnt - 1 - g->start) / LEAF_SECTORS);
+  g->dirty = true;
+}
+
+/* Returns the start of the first run of CNT free sectors that
+   lies within sectors LO up to HI, or BITMAP_ERROR if there is
+   none.  If BEST, returns the start of the shortest such run
+   instead. */
+static block_sector_t
+scan_leaf (block_sector_t lo, block_sector_t hi, size_t cnt, bool best)
+{
+  block_sector_t found = BITMAP_ERROR;
+  size_t found_len = SIZE_MAX;
+  block_sector_t sector = lo;
+
+  if (hi > bitmap_size (free_map))
+    hi = bitmap_size (free_map);
+  while (sector < hi)
+    {
+      block_sector_t start = sector;
+
+      while (sector < hi && is_free (sector))
+        sector++;
+      if (sector - start >= cnt && sector - start < found_len)
+        {
+          found = start;
+          found_len = sector - start;
+          if (!best)
+            break;
+        }
+      sector++;
+    }
+  return found;
+}
+
+/* Returns the start of the first run of CNT free sectors at or
+   after FROM within node I of G's index, which covers sectors LO
+   up to HI, or BITMAP_ERROR if there is none.  A run that begins
+   before FROM counts from FROM.  Runs that cross the boundary of
+   node I are the business of its ancestors. */
+static block_sector_t
+find_first (const struct block_group *g, size_t i,
+            block_sector_t lo, block_sector_t hi,
+            size_t cnt, block_sector_t from)
+{
+  const struct free_node *l, *r;
+  block_sector_t mid, start;
+
+  if (hi <= from || g->index[i].longest < cnt)
+    return BITMAP_ERROR;
+  if (i >= LEAF_CNT)
+    return scan_leaf (lo > from ? lo : from, hi, cnt, false);
+
+  /* Runs in the left half, then across the middle, then in the
+     right half. */
+  mid = lo + (hi - lo) / 2;
+  start = find_first (g, 2 * i, lo, mid, cnt, from);
+  if (start != BITMAP_ERROR)
+    return start;
+  l = &g->index[2 * i];
+  r = &g->index[2 * i + 1];
+  start = mid - l->suffix > from ? mid - l->suffix : from;
+  if (start < mid && mid - start + r->prefix >= cnt)
+    return start;
+  return find_first (g, 2 * i + 1, mid, hi, cnt, from);
+}
+
+/* Returns the start of a run of CNT free sectors within node I of
+   G's index, which covers sectors LO up to HI and must have such
+   a run.  At each level descends toward the candidate whose
+   longest run is shortest, which approximates best fit without
+   visiting more than one node per level. */
+static block_sector_t
+find_best (const struct block_group *g, size_t i,
+           block_sector_t lo, block_sector_t hi, size_t cnt)
+{
+  const struct free_node *l, *r;
+  block_sector_t mid;
+  size_t cross;
+
+  if (i >= LEAF_CNT)
+    return scan_leaf (lo, hi, cnt, true);
+
+  mid = lo + (hi - lo) / 2;
+  l = &g->index[2 * i];
+  r = &g->index[2 * i + 1];
+  cross = l->suffix + r->prefix;
+  if (l->longest >= cnt && (cross < cnt || l->longest <= cross)
+      && (r->longest < cnt || l->longest <= r->longest))
+    return find_best (g, 2 * i, lo, mid, cnt);
+  else if (cross >= cnt && (r->longest < cnt || cross <= r->longest))
+    return mid - l->suffix;
+  else
+    return find_best (g, 2 * i + 1, mid, hi, cnt);
+}
+
+/* Allocates a run of CNT free sectors in G, searching from NEAR if
+   it lies in G, and returns its start, or BITMAP_ERROR if G has
+   no such run.  Must be called with G's lock held. */
+static block_sector_t
+group_allocate (struct block_group *g, block_sector_t near, size_t cnt)
+{
+  block_sector_t end = g->start + GROUP_SECTORS;
+  block_sector_t sector;
+
+  if (g->index[1].longest < cnt)
+    return BITMAP_ERROR;
+  if (cnt >= LARGE_REQUEST)
+    sector = find_best (g, 1, g->start, end, cnt);
+  else
+    {
+      block_sector_t from = (near >= g->start && near < end
+                             ? near : g->next_fit);
+
+      sector = find_first (g, 1, g->start, end, cnt, from);
+      if (sector == BITMAP_ERROR)
+        sector = find_first (g, 1, g->start, end, cnt, g->start);
+      g->next_fit = sector + cnt;
+    }
+  ASSERT (sector != BITMAP_ERROR);
+
+  bitmap_set_multiple (free_map, sector, cnt, true);
+  group_update (g, sector, cnt);
+  return sector;
 }
@@ -1,20 +1,51 @@
 #include "filesys/inode.h"
 #include <debug.h>
+#include <iovec.h>
+#include <list.h>
 #include <round.h>
 #include <string.h>
+#include "filesys/cache.h"
 #include "filesys/filesys.h"
 #include "filesys/free-map.h"
+#include "filesys/journal.h"
+#include "filesys/refcount.h"
 #include "threads/malloc.h"
+#include "threads/thread.h"
 
 /* Identifies an inode. */
 #define INODE_MAGIC 0x494e4f44
 
+/* Most sectors a file using the indexed layout can have. */
+#define INDEXED_MAX_SECTORS (10 + 128 + 128 * 128)
+
+/* Identifies an inode that uses the extent layout. */
+#define INODE_EXTENT_MAGIC 0x494e4f45
+
+/* Extents held by one leaf block, and leaf blocks listed by one
+   extent_index block. */
+#define EXTENT_LEAF_CNT 42
+#define EXTENT_INDEX_CNT (BLOCK_SECTOR_SIZE / sizeof (block_sector_t))
+
+/* Most extents an inode can have. */
+#define EXTENT_MAX (INODE_INLINE_EXTENTS + EXTENT_INDEX_CNT * EXTENT_LEAF_CNT)
+
+/* Leaf block of the extent tree.
+   Must be exactly BLOCK_SECTOR_SIZE bytes long. */
+struct extent_leaf
+  {
+    struct inode_extent extents[EXTENT_LEAF_CNT];
+    uint32_t unused[2];                 /* Not used. */
+  };
+
+/* Magic number of the inodes that inode_create() makes. */
+static unsigned new_inode_magic = INODE_MAGIC;
+
+/* A sector of zeros, written over newly allocated sectors. */
+static char zeros[BLOCK_SECTOR_SIZE];
+
 #define NEXT_BLOCKSIZE(x) (x % BLOCK_SECTOR_SIZE) ? (x + (BLOCK_SECTOR_SIZE - (x % BLOCK_SECTOR_SIZE))) : x;
 
-bool inode_disk_add_sector(block_sector_t sector, struct inode_disk *inode, off_t offset);
 void offset_to_arrIndex(off_t off, int* dirInd, int* indirOff, int* dIndirOff1, int* dIndirOff2);
-bool fillZeros(block_sector_t, struct inode_disk *, int, int, int, int);
-void fillSector(block_sector_t);
 
 /* Returns the number of sectors to allocate for an inode SIZE
    bytes long. */
@@ -24,291 +55,1338 @@ bytes_to_sectors (off_t size)
   return DIV_ROUND_UP (size, BLOCK_SECTOR_SIZE);
 }
 
-void fillSector(block_sector_t sec) {
-  // ensure that unalloced blocks are marked as unalloced
-  block_sector_t* blocks = malloc(sizeof(block_sector_t) * 128);
-  memset(blocks, 0xFF, sizeof(block_sector_t) * 128);
-  block_write (fs_device, sec, blocks);
-  free(blocks);
+/* Returns true if index entry SECTOR refers to a disk sector,
+   false if it is a hole. */
+static inline bool
+is_allocated (block_sector_t sector)
+{
+  return sector != 0xFFFFFFFF && sector != 0;
+}
+
+/* Returns true if INODE keeps its data in its inline_data. */
+static inline bool
+is_inline (const struct inode *inode)
+{
+  return (inode->data.flags & INODE_INLINE) != 0;
+}
+
+/* Returns true if data sector SECTOR of INODE belongs to another
+   inode too.  Only inodes that have taken part in a clone consult
+   the reference counts, so that writers to other files do not
+   contend for them. */
+static bool
+is_shared (const struct inode *inode, block_sector_t sector)
+{
+  return (inode->data.flags & INODE_SHARED) != 0 && refcount_shared (sector);
+}
+
+static void reclaim_later (struct inode *, block_sector_t, size_t cnt,
+                           int level);
+
+/* Returns the in-memory copy of index block SECTOR, reading it
+   through the buffer cache into a new buffer stored in *MAP if
+   it is not cached yet. */
+static block_sector_t *
+load_map (block_sector_t **map, block_sector_t sector)
+{
+  if (*map == NULL)
+    {
+      *map = malloc (BLOCK_SECTOR_SIZE);
+      if (*map == NULL)
+        PANIC ("Heap ran out of space and couldnt allocate for index block cache");
+      cache_read (sector, *map);
+    }
+  return *map;
+}
+
+/* Returns the in-memory copy of SECTOR, the second-level
+   double-indirect block found at entry INDEX of INODE's
+   doubleIndirect block.  Only INODE_MAP_SLOTS such blocks are
+   kept; a miss replaces the slots round-robin. */
+static block_sector_t *
+load_second_map (struct inode *inode, int index, block_sector_t sector)
+{
+  struct inode_map *slot;
+  int i;
+
+  for (i = 0; i < INODE_MAP_SLOTS; i++)
+    if (inode->maps[i].index == index)
+      return inode->maps[i].entries;
+
+  slot = &inode->maps[inode->map_next];
+  inode->map_next = (inode->map_next + 1) % INODE_MAP_SLOTS;
+  slot->index = -1;
+  if (slot->entries == NULL)
+    load_map (&slot->entries, sector);
+  else
+    cache_read (sector, slot->entries);
+  slot->index = index;
+  return slot->entries;
+}
+
+/* Drops INODE's cached index blocks.  Must be called whenever the
+   on-disk index blocks may have changed.  The caller must hold
+   INODE's map_lock unless no one else can reach INODE. */
+static void
+invalidate_maps (struct inode *inode)
+{
+  int i;
+
+  free (inode->indirect_map);
+  inode->indirect_map = NULL;
+  free (inode->dindirect_map);
+  inode->dindirect_map = NULL;
+  for (i = 0; i < INODE_MAP_SLOTS; i++)
+    {
+      free (inode->maps[i].entries);
+      inode->maps[i].entries = NULL;
+      inode->maps[i].index = -1;
+    }
+  inode->map_next = 0;
+}
+
+/* Writes INODE's on-disk inode back, as part of the running
+   transaction, if it has changed since it was read or last
+   written back. */
+static void
+write_back (struct inode *inode)
+{
+  if (inode->dirty)
+    {
+      cache_write_meta (inode->sector, &inode->data);
+      inode->dirty = false;
+    }
+}
+
+/* Sectors reserved from the free map as one contiguous run and
+   handed out one at a time. */
+struct reservation
+  {
+    block_sector_t next;                /* Next sector to hand out. */
+    size_t left;                        /* Sectors left in the run. */
+    block_sector_t near;                /* Reserve close to this. */
+  };
+
+/* Stores the next reserved sector of R into *SECTORP.  When R runs
+   dry, reserves the longest contiguous run of up to WANT sectors
+   that the free map can supply, as close to R's NEAR as it can.
+   Returns false if the disk is full. */
+static bool
+reserve_sector (struct reservation *r, size_t want, block_sector_t *sectorp)
+{
+  if (r->left == 0)
+    {
+      size_t cnt;
+
+      for (cnt = want > 0 ? want : 1; cnt > 0; cnt /= 2)
+        if (free_map_allocate (r->near, cnt, &r->next))
+          break;
+      if (cnt == 0)
+        return false;
+      r->left = cnt;
+    }
+  *sectorp = r->next++;
+  r->left--;
+  return true;
+}
+
+/* Returns the unused sectors of R to the free map. */
+static void
+reservation_release (struct reservation *r)
+{
+  if (r->left > 0)
+    free_map_release (r->next, r->left);
+  r->left = 0;
+}
+
+/* Reads index block SECTOR into BLOCKS, or, if SECTOR is not
+   allocated yet, allocates it from R and fills BLOCKS with
+   unallocated entries.  Sets *DIRTY if BLOCKS must be written
+   back.  Returns false if the disk is full. */
+static bool
+get_index_block (block_sector_t *sector, block_sector_t *blocks,
+                 struct reservation *r, size_t want, bool *dirty)
+{
+  if (*sector != 0xFFFFFFFF)
+    {
+      cache_read (*sector, blocks);
+      *dirty = false;
+      return true;
+    }
+  if (!reserve_sector (r, want, sector))
+    return false;
+  memset (blocks, 0xFF, BLOCK_SECTOR_SIZE);
+  *dirty = true;
+  return true;
+}
+
+/* Backs file sectors FROM through TO - 1 of DISK_INODE, which uses
+   the indexed layout and lives at SECTOR, with zeroed disk sectors
+   near SECTOR wherever they are not backed yet.  Sectors outside
+   that range are left alone, so they may stay holes.  Data and
+   index blocks are reserved in contiguous runs, and each index
+   block is read and written at most once.  DISK_INODE itself is
+   not written; that is left to the caller.  Returns false if the
+   disk fills up or TO is beyond the largest file the layout can
+   describe. */
+static bool
+inode_disk_grow (struct inode_disk *disk_inode, block_sector_t sector,
+                 size_t from, size_t to)
+{
+  struct reservation r = {0, 0, sector};
+  block_sector_t *indirect = NULL;      /* Copy of indirect block. */
+  block_sector_t *first = NULL;         /* Copy of doubleIndirect. */
+  block_sector_t *second = NULL;        /* Copy of a second-level block. */
+  bool indirect_dirty = false;
+  bool first_dirty = false;
+  bool second_dirty = false;
+  int second_idx = -1;                  /* Entry of SECOND in FIRST. */
+  bool success = true;
+  size_t i;
+
+  if (to > INDEXED_MAX_SECTORS)
+    return false;
+
+  indirect = malloc (BLOCK_SECTOR_SIZE);
+  first = malloc (BLOCK_SECTOR_SIZE);
+  second = malloc (BLOCK_SECTOR_SIZE);
+  if (indirect == NULL || first == NULL || second == NULL)
+    PANIC ("Heap ran out of space and couldnt allocate for index blocks");
+
+  for (i = from; i < to && success; i++)
+    {
+      size_t want = to - i;
+      block_sector_t *slot;
+      bool *slot_dirty;
+
+      if (i < 10)
+        {
+          slot = &disk_inode->direct[i];
+          slot_dirty = NULL;
+        }
+      else if (i < 10 + 128)
+        {
+          if (i == from || i == 10)
+            success = get_index_block (&disk_inode->indirect, indirect,
+                                       &r, want, &indirect_dirty);
+          slot = &indirect[i - 10];
+          slot_dirty = &indirect_dirty;
+        }
+      else
+        {
+          int idx1 = (i - (10 + 128)) / 128;
+
+          if (i == from || i == 10 + 128)
+            success = get_index_block (&disk_inode->doubleIndirect, first,
+                                       &r, want, &first_dirty);
+          if (success && idx1 != second_idx)
+            {
+              if (second_dirty)
+                {
+                  cache_write_meta (first[second_idx], second);
+                  second_dirty = false;
+                }
+              if (first[idx1] == 0xFFFFFFFF)
+                first_dirty = true;
+              success = get_index_block (&first[idx1], second, &r, want,
+                                         &second_dirty);
+              if (success)
+                second_idx = idx1;
+            }
+          slot = &second[(i - (10 + 128)) % 128];
+          slot_dirty = &second_dirty;
+        }
+
+      if (success && !is_allocated (*slot))
+        {
+          success = reserve_sector (&r, want, slot);
+          if (success)
+            {
+              cache_write_new (*slot, zeros);
+              if (slot_dirty != NULL)
+                *slot_dirty = true;
+            }
+          else
+            *slot = 0xFFFFFFFF;
+        }
+    }
+
+  /* Write back the index blocks, even after a failure, so that
+     every sector handed out stays reachable from the inode. */
+  if (indirect_dirty)
+    cache_write_meta (disk_inode->indirect, indirect);
+  if (second_dirty)
+    cache_write_meta (first[second_idx], second);
+  if (first_dirty)
+    cache_write_meta (disk_inode->doubleIndirect, first);
+  reservation_release (&r);
+
+  free (indirect);
+  free (first);
+  free (second);
+  return success;
+}
+
+/* Releases the CNT data sectors starting at SECTOR.  A sector
+   that another inode shares after a clone just loses a reference;
+   the runs of the others go back to the free map. */
+static void
+release_data (block_sector_t sector, size_t cnt)
+{
+  while (cnt > 0)
+    {
+      bool shared;
+      size_t n = refcount_put (sector, cnt, &shared);
+
+      if (!shared)
+        free_map_release (sector, n);
+      sector += n;
+      cnt -= n;
+    }
+}
+
+/* Releases the allocated sectors among the CNT in SECTORS,
+   which are data sectors, handing each run of consecutive
+   sectors to release_data() at once. */
+static void
+release_sectors (const block_sector_t *sectors, size_t cnt)
+{
+  size_t i = 0;
+
+  while (i < cnt)
+    {
+      size_t n = 1;
+
+      if (!is_allocated (sectors[i]))
+        {
+          i++;
+          continue;
+        }
+      while (i + n < cnt && sectors[i + n] == sectors[i] + n)
+        n++;
+      release_data (sectors[i], n);
+      i += n;
+    }
+}
+
+/* Releases index block SECTOR and everything it refers to.  A
+   LEVEL 1 block lists data sectors, a LEVEL 2 block lists LEVEL 1
+   blocks. */
+static void
+release_index (block_sector_t sector, int level)
+{
+  block_sector_t *blocks = malloc (BLOCK_SECTOR_SIZE);
+  int i;
+
+  if (blocks == NULL)
+    PANIC ("Heap ran out of space and couldnt allocate for index blocks");
+
+  cache_read (sector, blocks);
+  if (level == 1)
+    release_sectors (blocks, 128);
+  else
+    for (i = 0; i < 128; i++)
+      if (is_allocated (blocks[i]))
+        release_index (blocks[i], level - 1);
+  free_map_release (sector, 1);
+  free (blocks);
+}
+
+/* Releases every data and index block of DISK_INODE, which uses
+   the indexed layout, skipping holes. */
+static void
+inode_disk_release (struct inode_disk *disk_inode)
+{
+  release_sectors (disk_inode->direct, 10);
+  if (is_allocated (disk_inode->indirect))
+    release_index (disk_inode->indirect, 1);
+  if (is_allocated (disk_inode->doubleIndirect))
+    release_index (disk_inode->doubleIndirect, 2);
+}
+
+/* Releases the entries of index block SECTOR from entry KEEP
+   onward, which list data sectors, and writes the block back. */
+static void
+trim_index (block_sector_t sector, size_t keep)
+{
+  block_sector_t *blocks = malloc (BLOCK_SECTOR_SIZE);
+
+  if (blocks == NULL)
+    PANIC ("Heap ran out of space and couldnt allocate for index blocks");
+
+  cache_read (sector, blocks);
+  release_sectors (blocks + keep, 128 - keep);
+  memset (blocks + keep, 0xFF, (128 - keep) * sizeof *blocks);
+  cache_write_meta (sector, blocks);
+  free (blocks);
+}
+
+/* Shrinks DISK_INODE, which uses the indexed layout, to its first
+   KEEP sectors.  Index blocks past the cut are handed whole to
+   the reclamation thread; the ones the cut falls in are trimmed
+   in place.  The caller writes the inode afterward. */
+static void
+indexed_truncate (struct inode_disk *disk_inode, size_t keep)
+{
+  if (keep < 10)
+    {
+      release_sectors (disk_inode->direct + keep, 10 - keep);
+      memset (disk_inode->direct + keep, 0xFF,
+              (10 - keep) * sizeof *disk_inode->direct);
+    }
+
+  /* The indirect block covers sectors 10 through 137. */
+  if (is_allocated (disk_inode->indirect))
+    {
+      if (keep <= 10)
+        {
+          reclaim_later (NULL, disk_inode->indirect, 1, 1);
+          disk_inode->indirect = 0xFFFFFFFF;
+        }
+      else if (keep < 10 + 128)
+        trim_index (disk_inode->indirect, keep - 10);
+    }
+
+  /* The doubly indirect block covers the rest. */
+  if (is_allocated (disk_inode->doubleIndirect))
+    {
+      if (keep <= 10 + 128)
+        {
+          reclaim_later (NULL, disk_inode->doubleIndirect, 1, 2);
+          disk_inode->doubleIndirect = 0xFFFFFFFF;
+        }
+      else
+        {
+          size_t rest = keep - (10 + 128);
+          block_sector_t *first = malloc (BLOCK_SECTOR_SIZE);
+          size_t i;
+
+          if (first == NULL)
+            PANIC ("Heap ran out of space and couldnt allocate for index blocks");
+
+          cache_read (disk_inode->doubleIndirect, first);
+          if (rest % 128 != 0 && is_allocated (first[rest / 128]))
+            trim_index (first[rest / 128], rest % 128);
+          for (i = DIV_ROUND_UP (rest, 128); i < 128; i++)
+            if (is_allocated (first[i]))
+              {
+                reclaim_later (NULL, first[i], 1, 1);
+                first[i] = 0xFFFFFFFF;
+              }
+          cache_write_meta (disk_inode->doubleIndirect, first);
+          free (first);
+        }
+    }
+}
+
+/* Reads the extents of INODE, which uses the extent layout, into
+   memory.  Returns false if memory allocation fails. */
+static bool
+extent_load (struct inode *inode)
+{
+  size_t cnt = inode->data.extent_cnt;
+  size_t inline_cnt = cnt < INODE_INLINE_EXTENTS ? cnt : INODE_INLINE_EXTENTS;
+
+  inode->extents = malloc ((cnt > 0 ? cnt : 1) * sizeof *inode->extents);
+  if (inode->extents == NULL)
+    return false;
+  inode->extent_cnt = cnt;
+  memcpy (inode->extents, inode->data.extents,
+          inline_cnt * sizeof *inode->extents);
+
+  if (cnt > INODE_INLINE_EXTENTS)
+    {
+      block_sector_t *index = malloc (BLOCK_SECTOR_SIZE);
+      struct extent_leaf *leaf = malloc (sizeof *leaf);
+      size_t i, base;
+
+      if (index == NULL || leaf == NULL)
+        {
+          free (index);
+          free (leaf);
+          free (inode->extents);
+          inode->extents = NULL;
+          return false;
+        }
+      cache_read (inode->data.extent_index, index);
+      for (i = 0, base = INODE_INLINE_EXTENTS; base < cnt;
+           i++, base += EXTENT_LEAF_CNT)
+        {
+          size_t n = cnt - base < EXTENT_LEAF_CNT ? cnt - base : EXTENT_LEAF_CNT;
+          cache_read (index[i], leaf);
+          memcpy (inode->extents + base, leaf->extents,
+                  n * sizeof *inode->extents);
+        }
+      free (index);
+      free (leaf);
+    }
+  return true;
+}
+
+/* Writes the extents of INODE from extent FROM onward back to
+   disk, followed by the inode itself.  Leaf blocks and the index
+   block are allocated as needed.
+   Returns false if one of them could not be allocated. */
+static bool
+extent_store (struct inode *inode, size_t from)
+{
+  size_t cnt = inode->extent_cnt;
+  size_t inline_cnt = cnt < INODE_INLINE_EXTENTS ? cnt : INODE_INLINE_EXTENTS;
+  bool success = true;
+
+  inode->data.extent_cnt = cnt;
+  memcpy (inode->data.extents, inode->extents,
+          inline_cnt * sizeof *inode->extents);
+
+  if (cnt > INODE_INLINE_EXTENTS)
+    {
+      block_sector_t *index = malloc (BLOCK_SECTOR_SIZE);
+      struct extent_leaf *leaf = malloc (sizeof *leaf);
+      bool index_dirty = false;
+
+      ASSERT (sizeof *leaf == BLOCK_SECTOR_SIZE);
+      if (index == NULL || leaf == NULL)
+        PANIC ("Heap ran out of space and couldnt allocate for extent blocks");
+
+      if (inode->data.extent_index != 0xFFFFFFFF)
+        cache_read (inode->data.extent_index, index);
+      else if (free_map_allocate (inode->sector, 1,
+                                  &inode->data.extent_index))
+        {
+          memset (index, 0xFF, BLOCK_SECTOR_SIZE);
+          index_dirty = true;
+        }
+      else
+        success = false;
+
+      if (success)
+        {
+          size_t first = from < INODE_INLINE_EXTENTS
+                         ? 0 : (from - INODE_INLINE_EXTENTS) / EXTENT_LEAF_CNT;
+          size_t last = (cnt - INODE_INLINE_EXTENTS - 1) / EXTENT_LEAF_CNT;
+          size_t i;
+
+          for (i = first; i <= last; i++)
+            {
+              size_t base = INODE_INLINE_EXTENTS + i * EXTENT_LEAF_CNT;
+              size_t n = cnt - base < EXTENT_LEAF_CNT ? cnt - base : EXTENT_LEAF_CNT;
+
+              if (index[i] == 0xFFFFFFFF)
+                {
+                  if (!free_map_allocate (inode->sector, 1, &index[i]))
+                    {
+                      success = false;
+                      break;
+                    }
+                  index_dirty = true;
+                }
+              memset (leaf, 0, sizeof *leaf);
+              memcpy (leaf->extents, inode->extents + base,
+                      n * sizeof *inode->extents);
+              cache_write_meta (index[i], leaf);
+            }
+          if (index_dirty)
+            cache_write_meta (inode->data.extent_index, index);
+        }
+      free (index);
+      free (leaf);
+    }
+
+  inode->dirty = true;
+  write_back (inode);
+  return success;
+}
+
+/* Returns the disk sector holding file sector LOGICAL of INODE,
+   which uses the extent layout, or -1 if there is none.
+   The caller must hold INODE's map_lock. */
+static block_sector_t
+extent_lookup (const struct inode *inode, uint32_t logical)
+{
+  size_t lo = 0;
+  size_t hi = inode->extent_cnt;
+
+  while (lo < hi)
+    {
+      size_t mid = (lo + hi) / 2;
+      const struct inode_extent *e = &inode->extents[mid];
+
+      if (logical < e->logical)
+        hi = mid;
+      else if (logical >= e->logical + e->length)
+        lo = mid + 1;
+      else
+        return e->start + (logical - e->logical);
+    }
+  return -1;
+}
+
+/* Backs file sectors FIRST through LAST - 1 of INODE, which uses
+   the extent layout, with zeroed disk sectors wherever they are
+   holes.  A hole that starts where an extent ends is filled by
+   extending that extent in place if the sectors after it on disk
+   are free.  Otherwise the longest run the free map can supply, up
+   to the size of the hole, becomes a new extent.
+   Returns false if the disk or the extent tree fills up.
+   The caller must hold INODE's map_lock. */
+static bool
+extent_grow (struct inode *inode, size_t first, size_t last)
+{
+  size_t from = inode->extent_cnt;      /* First extent changed. */
+  size_t logical = first;
+  size_t idx = 0;
+  bool success = true;
+
+  while (logical < last)
+    {
+      struct inode_extent *prev;
+      block_sector_t start = 0;
+      size_t want, got = 0;
+      size_t i;
+
+      /* Find the first extent that ends after LOGICAL, and skip
+         over it if it covers LOGICAL. */
+      while (idx < inode->extent_cnt
+             && (inode->extents[idx].logical + inode->extents[idx].length
+                 <= logical))
+        idx++;
+      if (idx < inode->extent_cnt && inode->extents[idx].logical <= logical)
+        {
+          logical = inode->extents[idx].logical + inode->extents[idx].length;
+          continue;
+        }
+
+      /* LOGICAL is in a hole that ends at extent IDX or LAST. */
+      want = (idx < inode->extent_cnt && inode->extents[idx].logical < last
+              ? inode->extents[idx].logical : last) - logical;
+      prev = idx > 0 ? &inode->extents[idx - 1] : NULL;
+      if (prev != NULL && prev->logical + prev->length == logical)
+        {
+          start = prev->start + prev->length;
+          got = free_map_extend (start, want);
+        }
+
+      if (got > 0)
+        {
+          prev->length += got;
+          if (from > idx - 1)
+            from = idx - 1;
+        }
+      else
+        {
+          struct inode_extent *extents;
+          block_sector_t near = (prev != NULL ? prev->start + prev->length
+                                 : inode->sector);
+
+          if (inode->extent_cnt >= EXTENT_MAX)
+            {
+              success = false;
+              break;
+            }
+          for (got = want; got > 0; got /= 2)
+            if (free_map_allocate (near, got, &start))
+              break;
+          if (got == 0)
+            {
+              success = false;
+              break;
+            }
+          extents = realloc (inode->extents,
+                             (inode->extent_cnt + 1) * sizeof *extents);
+          if (extents == NULL)
+            {
+              free_map_release (start, got);
+              success = false;
+              break;
+            }
+          inode->extents = extents;
+          memmove (extents + idx + 1, extents + idx,
+                   (inode->extent_cnt - idx) * sizeof *extents);
+          extents[idx].logical = logical;
+          extents[idx].start = start;
+          extents[idx].length = got;
+          inode->extent_cnt++;
+          if (from > idx)
+            from = idx;
+        }
+
+      for (i = 0; i < got; i++)
+        cache_write_new (start + i, zeros);
+      logical += got;
+    }
+
+  if (from < inode->extent_cnt && !extent_store (inode, from))
+    success = false;
+  return success;
+}
+
+/* Releases every sector of INODE, which uses the extent layout,
+   including its extent tree blocks. */
+static void
+extent_release (struct inode *inode)
+{
+  size_t i;
+
+  for (i = 0; i < inode->extent_cnt; i++)
+    release_data (inode->extents[i].start, inode->extents[i].length);
+
+  if (inode->data.extent_index != 0xFFFFFFFF)
+    {
+      block_sector_t *index = malloc (BLOCK_SECTOR_SIZE);
+      if (index == NULL)
+        PANIC ("Heap ran out of space and couldnt allocate for extent index");
+      cache_read (inode->data.extent_index, index);
+      for (i = 0; i < EXTENT_INDEX_CNT && index[i] != 0xFFFFFFFF; i++)
+        free_map_release (index[i], 1);
+      free_map_release (inode->data.extent_index, 1);
+      free (index);
+    }
+  inode->extent_cnt = 0;
+  inode->data.extent_cnt = 0;
+  inode->data.extent_index = 0xFFFFFFFF;
+  inode->dirty = true;
+}
+
+/* Shrinks INODE, which uses the extent layout, to its first KEEP
+   sectors, handing the sectors cut off to the reclamation thread.
+   Leaf blocks that fall out of use stay allocated for regrowth
+   and are released with the inode.
+   The caller must hold INODE's map_lock. */
+static void
+extent_truncate (struct inode *inode, size_t keep)
+{
+  size_t cnt = inode->extent_cnt;
+  size_t from = cnt;                    /* First extent changed. */
+
+  while (cnt > 0)
+    {
+      struct inode_extent *e = &inode->extents[cnt - 1];
+
+      if (e->logical >= keep)
+        {
+          reclaim_later (NULL, e->start, e->length, 0);
+          from = --cnt;
+        }
+      else
+        {
+          if (e->logical + e->length > keep)
+            {
+              size_t n = keep - e->logical;
+              reclaim_later (NULL, e->start + n, e->length - n, 0);
+              e->length = n;
+              from = cnt - 1;
+            }
+          break;
+        }
+    }
+  inode->extent_cnt = cnt;
+
+  /* Nothing needs allocating when shrinking, so this succeeds. */
+  extent_store (inode, from);
+}
+
+/* Makes file sector LOGICAL of INODE, which uses the extent
+   layout and has that sector, refer to disk sector SECTOR
+   instead.  The new sector joins the extent before it when it
+   directly follows that extent on disk; otherwise the extent that
+   held LOGICAL is split around it.
+   Returns false if the extent tree fills up.
+   The caller must hold INODE's map_lock. */
+static bool
+extent_remap (struct inode *inode, uint32_t logical, block_sector_t sector)
+{
+  size_t cnt = inode->extent_cnt;
+  struct inode_extent *saved, *extents, *e;
+  size_t idx, ofs, added;
+  size_t lo = 0, hi = cnt;
+
+  /* Find the extent that holds LOGICAL. */
+  for (;;)
+    {
+      idx = (lo + hi) / 2;
+      ASSERT (lo < hi);
+      e = &inode->extents[idx];
+      if (logical < e->logical)
+        hi = idx;
+      else if (logical >= e->logical + e->length)
+        lo = idx + 1;
+      else
+        break;
+    }
+  ofs = logical - e->logical;
+
+  if (e->length == 1)
+    {
+      e->start = sector;
+      return extent_store (inode, idx);
+    }
+  if (ofs == 0 && idx > 0 && e[-1].logical + e[-1].length == logical
+      && e[-1].start + e[-1].length == sector)
+    {
+      e[-1].length++;
+      e->logical++;
+      e->start++;
+      e->length--;
+      return extent_store (inode, idx - 1);
+    }
+
+  /* Split E into the part before LOGICAL, LOGICAL itself, and the
+     part after it. */
+  added = (ofs > 0) + (ofs + 1 < e->length);
+  if (cnt + added > EXTENT_MAX)
+    return false;
+  saved = malloc (cnt * sizeof *saved);
+  extents = realloc (inode->extents, (cnt + added) * sizeof *extents);
+  if (saved == NULL || extents == NULL)
+    {
+      free (saved);
+      if (extents != NULL)
+        inode->extents = extents;
+      return false;
+    }
+  inode->extents = extents;
+  memcpy (saved, extents, cnt * sizeof *saved);
+
+  e = &extents[idx];
+  memmove (e + 1 + added, e + 1, (cnt - idx - 1) * sizeof *e);
+  if (ofs + 1 < saved[idx].length)
+    {
+      e[added].logical = logical + 1;
+      e[added].start = saved[idx].start + ofs + 1;
+      e[added].length = saved[idx].length - ofs - 1;
+    }
+  if (ofs > 0)
+    {
+      e->length = ofs;
+      e++;
+    }
+  e->logical = logical;
+  e->start = sector;
+  e->length = 1;
+  inode->extent_cnt = cnt + added;
+
+  if (!extent_store (inode, idx))
+    {
+      /* The tree is no bigger than before, so this succeeds. */
+      memcpy (inode->extents, saved, cnt * sizeof *saved);
+      inode->extent_cnt = cnt;
+      extent_store (inode, idx);
+      free (saved);
+      return false;
+    }
+  free (saved);
+  return true;
+}
+
+/* Makes file sector LOGICAL of INODE, which uses the indexed
+   layout and has that sector, refer to disk sector SECTOR
+   instead.  The caller must hold INODE's map_lock and write INODE
+   back afterward. */
+static void
+indexed_remap (struct inode *inode, size_t logical, block_sector_t sector)
+{
+  block_sector_t *blocks;
+  block_sector_t index;
+
+  if (logical < 10)
+    {
+      inode->data.direct[logical] = sector;
+      inode->dirty = true;
+      return;
+    }
+
+  blocks = malloc (BLOCK_SECTOR_SIZE);
+  if (blocks == NULL)
+    PANIC ("Heap ran out of space and couldnt allocate for index blocks");
+  if (logical < 10 + 128)
+    {
+      index = inode->data.indirect;
+      logical -= 10;
+    }
+  else
+    {
+      logical -= 10 + 128;
+      cache_read (inode->data.doubleIndirect, blocks);
+      index = blocks[logical / 128];
+      logical %= 128;
+    }
+  cache_read (index, blocks);
+  blocks[logical] = sector;
+  cache_write_meta (index, blocks);
+  free (blocks);
+  invalidate_maps (inode);
+}
+
+/* Creates the extent inode described by DISK_INODE at SECTOR and
+   allocates its data. */
+static bool
+extent_create (block_sector_t sector, const struct inode_disk *disk_inode)
+{
+  struct inode *inode;
+  bool success;
+
+  cache_write_meta (sector, disk_inode);
+  inode = inode_open (sector);
+  if (inode == NULL)
+    return false;
+
+  lock_acquire (&inode->map_lock);
+  success = extent_grow (inode, 0, bytes_to_sectors (disk_inode->length));
+  if (!success)
+    extent_release (inode);
+  lock_release (&inode->map_lock);
+  inode_close (inode);
+  return success;
 }
 
 /* Returns the block device sector that contains byte offset POS
    within INODE.
    Returns -1 if INODE does not contain data for a byte at offset
-   POS. */
+   POS.
+   Index blocks are cached in INODE after their first use, so
+   repeated lookups do not touch the buffer cache. */
 static block_sector_t
-byte_to_sector (const struct inode *inode, off_t pos)
+byte_to_sector (struct inode *inode, off_t pos)
 {
+  block_sector_t result = -1;
+
   ASSERT (inode != NULL);
-  if (pos < inode->data.length) {
-    int dir, indir, dIndir1, dIndir2;
-    offset_to_arrIndex(pos, &dir, &indir, &dIndir1, &dIndir2);
-    if(dir != -1) {
-      return inode->data.direct[dir];
-    }
-    else if(indir != -1) {
-      if(inode->data.indirect == 0xFFFFFFFF) {
-	return -1;
-      }      
-
-      block_sector_t newBlock;
-      block_sector_t* blocks = malloc(sizeof(block_sector_t) * 128);
-      if(!blocks) {
-	PANIC("Heap ran out of space and couldnt allocate for indirect block buffer");
-      }
-      
-      block_read(fs_device, inode->data.indirect, blocks);
-      newBlock = blocks[indir];
-	
-      free(blocks);
-      return newBlock;
-    
-    }
-    else {
-      block_sector_t newBlock;
-      block_sector_t* blocks = malloc(sizeof(block_sector_t) * 128);
-      if(!blocks) {
-	PANIC("Heap ran out of space and couldnt allocate for double indirect block buffer");
-      }
+  if (pos >= inode->data.length || is_inline (inode))
+    return -1;
 
-      if(inode->data.doubleIndirect == 0xFFFFFFFF) {
-	free(blocks);
-	return -1;
-      }
-      
-      block_sector_t secondLevelBlock;
-      block_read (fs_device, inode->data.doubleIndirect, blocks);
-      secondLevelBlock = blocks[dIndir1];
-      if(secondLevelBlock == 0xFFFFFFFF) {
-	free(blocks);
-	return -1;
-      }
-      block_read (fs_device, secondLevelBlock, blocks);
-      newBlock = blocks[dIndir2];
-      free(blocks);
-      return newBlock;
-      
+  if (inode->data.magic == INODE_EXTENT_MAGIC) {
+    lock_acquire (&inode->map_lock);
+    result = extent_lookup (inode, pos / BLOCK_SECTOR_SIZE);
+    lock_release (&inode->map_lock);
+    return result;
+  }
+
+  /* Past the largest file the indexed layout can describe. */
+  if ((size_t) pos / BLOCK_SECTOR_SIZE >= INDEXED_MAX_SECTORS)
+    return -1;
+
+  int dir, indir, dIndir1, dIndir2;
+  offset_to_arrIndex(pos, &dir, &indir, &dIndir1, &dIndir2);
+  if(dir != -1) {
+    return inode->data.direct[dir];
+  }
+
+  lock_acquire (&inode->map_lock);
+  if(indir != -1) {
+    if(inode->data.indirect != 0xFFFFFFFF) {
+      result = load_map (&inode->indirect_map, inode->data.indirect)[indir];
+    }
+  }
+  else if(inode->data.doubleIndirect != 0xFFFFFFFF) {
+    block_sector_t secondLevelBlock
+      = load_map (&inode->dindirect_map, inode->data.doubleIndirect)[dIndir1];
+    if(secondLevelBlock != 0xFFFFFFFF) {
+      result = load_second_map (inode, dIndir1, secondLevelBlock)[dIndir2];
     }
   }
+  lock_release (&inode->map_lock);
+  return result;
+}
+
+/* Backs bytes FROM through END - 1 of INODE with disk sectors and
+   drops the cached index blocks that may have been rewritten.
+   Holes outside that range are left alone.  Sectors are
+   allocated in bulk; the caller writes the inode afterward. */
+static bool
+inode_grow (struct inode *inode, off_t from, off_t end)
+{
+  bool success;
+
+  ASSERT (!is_inline (inode));
+  lock_acquire (&inode->map_lock);
+  if (inode->data.magic == INODE_EXTENT_MAGIC)
+    success = extent_grow (inode, from / BLOCK_SECTOR_SIZE,
+                           bytes_to_sectors (end));
   else
+    {
+      success = inode_disk_grow (&inode->data, inode->sector,
+                                 from / BLOCK_SECTOR_SIZE,
+                                 bytes_to_sectors (end));
+      inode->dirty = true;
+      invalidate_maps (inode);
+    }
+  lock_release (&inode->map_lock);
+  return success;
+}
+
+/* Moves the inline data of INODE to a disk sector of its own, so
+   that INODE can grow past INODE_INLINE_MAX bytes.  The caller
+   must hold INODE's rw lock for writing and write INODE back
+   afterward.  Returns false, leaving INODE inline, if the disk or
+   the heap is full. */
+static bool
+inline_to_blocks (struct inode *inode)
+{
+  off_t length = inode->data.length;
+  bool meta = inode->data.type != FILE || inode->sector == FREE_MAP_SECTOR;
+  uint8_t *data;
+
+  ASSERT (is_inline (inode));
+  data = malloc (INODE_INLINE_MAX);
+  if (data == NULL)
+    return false;
+  memcpy (data, inode->data.inline_data, INODE_INLINE_MAX);
+
+  inode->data.flags &= ~INODE_INLINE;
+  memset (inode->data.inline_data, 0, INODE_INLINE_MAX);
+  if (length > 0)
+    {
+      block_sector_t sector;
+
+      if (!inode_grow (inode, 0, length))
+        {
+          memcpy (inode->data.inline_data, data, INODE_INLINE_MAX);
+          inode->data.flags |= INODE_INLINE;
+          free (data);
+          return false;
+        }
+      sector = byte_to_sector (inode, 0);
+      if (meta)
+        cache_write_meta_at (sector, data, 0, length);
+      else
+        cache_write_at (sector, data, 0, length);
+    }
+  inode->dirty = true;
+  free (data);
+  return true;
+}
+
+/* Gives INODE a private copy of disk sector OLD, which holds its
+   file sector LOGICAL and which it shares with a clone, and
+   returns the copy.  The copy goes right after the disk sector of
+   the file sector before, if that is free, so that rewriting a
+   clone front to back leaves it contiguous.  Returns -1 if the
+   disk is full.  The caller must hold INODE's rw lock for writing
+   and write INODE back afterward. */
+static block_sector_t
+unshare_sector (struct inode *inode, size_t logical, block_sector_t old)
+{
+  block_sector_t near = old;
+  block_sector_t sector;
+  uint8_t *buffer;
+  bool success = true;
+
+  if (logical > 0)
+    {
+      block_sector_t prev = byte_to_sector (inode,
+                                            (logical - 1) * BLOCK_SECTOR_SIZE);
+      if (is_allocated (prev))
+        near = prev + 1;
+    }
+  buffer = malloc (BLOCK_SECTOR_SIZE);
+  if (buffer == NULL)
     return -1;
+  if (!free_map_allocate (near, 1, &sector))
+    {
+      free (buffer);
+      return -1;
+    }
+  cache_read (old, buffer);
+  cache_write_new (sector, buffer);
+  free (buffer);
+
+  lock_acquire (&inode->map_lock);
+  if (inode->data.magic == INODE_EXTENT_MAGIC)
+    success = extent_remap (inode, logical, sector);
+  else
+    indexed_remap (inode, logical, sector);
+  lock_release (&inode->map_lock);
+
+  if (!success)
+    {
+      free_map_release (sector, 1);
+      return -1;
+    }
+  release_data (old, 1);
+  return sector;
 }
 
-/* List of open inodes, so that opening a single inode twice
-   returns the same `struct inode'. */
-static struct list open_inodes;
+/* Open inodes, keyed by sector, so that opening a single inode
+   twice returns the same `struct inode'. */
+static struct hash open_inodes;
+
+/* Protects open_inodes and the open_cnt and busy members of
+   every open inode. */
+static struct lock open_inodes_lock;
+
+/* Signaled when an inode in open_inodes stops being busy. */
+static struct condition open_inodes_cond;
+
+static hash_hash_func inode_hash;
+static hash_less_func inode_less;
+
+/* Blocks waiting to be released by the reclamation thread, so
+   that closing a removed file or truncating one does not wait
+   for its index blocks to be read and its sectors freed. */
+struct reclaim_job
+  {
+    struct list_elem elem;              /* Element in reclaim_list. */
+    struct inode *inode;                /* Removed inode to free, or NULL. */
+    block_sector_t sector;              /* Otherwise, first sector... */
+    size_t cnt;                         /* ...and sector count, if LEVEL 0. */
+    int level;                          /* 0: data, 1: indirect, 2: doubly. */
+  };
+
+static struct list reclaim_list;        /* Queued reclaim_jobs. */
+static int reclaim_pending;             /* Jobs queued or running. */
+static struct lock reclaim_lock;        /* Protects the above. */
+static struct condition reclaim_cond;   /* Signaled when a job is queued. */
+static struct condition reclaim_done;   /* Signaled when all jobs finish. */
+
+static thread_func reclaim_thread NO_RETURN;
 
 /* Initializes the inode module. */
 void
 inode_init (void)
 {
-  list_init (&open_inodes);
+  if (!hash_init (&open_inodes, inode_hash, inode_less, NULL))
+    PANIC ("can't allocate open inode table");
+  lock_init (&open_inodes_lock);
+  cond_init (&open_inodes_cond);
+
+  list_init (&reclaim_list);
+  reclaim_pending = 0;
+  lock_init (&reclaim_lock);
+  cond_init (&reclaim_cond);
+  cond_init (&reclaim_done);
+  if (thread_create ("reclaim", PRI_DEFAULT, reclaim_thread, NULL)
+      == TID_ERROR)
+    PANIC ("couldn't start reclamation thread");
 }
 
-/* Initializes an inode with LENGTH bytes of data and
-   writes the new inode to sector SECTOR on the file system
-   device.
-   Returns true if successful.
-   Returns false if memory or disk allocation fails. */
-bool
-inode_create (block_sector_t sector, off_t length, enum inode_type type)
+/* Releases the blocks described by JOB. */
+static void
+reclaim (struct reclaim_job *job)
 {
-  struct inode_disk *disk_inode = NULL;
-  bool success = false;
+  struct inode *inode = job->inode;
 
-  ASSERT (length >= 0);
+  if (inode != NULL)
+    {
+      free_map_release (inode->sector, 1);
+      if (inode->data.magic == INODE_EXTENT_MAGIC)
+        extent_release (inode);
+      else
+        inode_disk_release (&inode->data);
+      free (inode->extents);
+      free (inode);
+    }
+  else if (job->level == 0)
+    release_data (job->sector, job->cnt);
+  else
+    release_index (job->sector, job->level);
+}
 
-  /* If this assertion fails, the inode structure is not exactly
-     one sector in size, and you should fix that. */
-  ASSERT (sizeof *disk_inode == BLOCK_SECTOR_SIZE);
+/* Has the reclamation thread release INODE, a removed inode that
+   nobody has open, with all its blocks, or else the CNT data
+   sectors starting at SECTOR if LEVEL is 0 or index block SECTOR
+   with everything under it if LEVEL is 1 or 2.  Does the work
+   right away if memory is short. */
+static void
+reclaim_later (struct inode *inode, block_sector_t sector, size_t cnt,
+               int level)
+{
+  struct reclaim_job *job = malloc (sizeof *job);
 
-  disk_inode = calloc (1, sizeof *disk_inode);
-  if (disk_inode != NULL)
+  if (job == NULL)
     {
-      disk_inode->length = length;
-      disk_inode->type   = type;
-      disk_inode->magic  = INODE_MAGIC;
-      disk_inode->indirect       = 0xFFFFFFFF;
-      disk_inode->doubleIndirect = 0xFFFFFFFF;
-      for(int i = 0; i < 10; i++) {
-	disk_inode->direct[i] = 0xFFFFFFFF;
-      }
+      struct reclaim_job now;
+      now.inode = inode;
+      now.sector = sector;
+      now.cnt = cnt;
+      now.level = level;
+      reclaim (&now);
+      return;
+    }
+  job->inode = inode;
+  job->sector = sector;
+  job->cnt = cnt;
+  job->level = level;
+
+  lock_acquire (&reclaim_lock);
+  list_push_back (&reclaim_list, &job->elem);
+  reclaim_pending++;
+  cond_signal (&reclaim_cond, &reclaim_lock);
+  lock_release (&reclaim_lock);
+}
 
-      // new allocator
-      for(off_t i = 0; i <= bytes_to_sectors(length); i++) {
-	if(!inode_disk_add_sector(sector, disk_inode, i*BLOCK_SECTOR_SIZE)) {
-	  success = false;
-	  break;
-	}
-	else {
-	  success = true;
-	}
-      }
-      if(success) {
-	block_write(fs_device, sector, disk_inode);
-      }
-      free(disk_inode);
+/* Reclamation thread.  Releases queued blocks in the order they
+   were queued.  Freed sectors reach the free map file with the
+   next journal commit, so a burst of releases costs one write
+   per free map sector changed. */
+static void
+reclaim_thread (void *aux UNUSED)
+{
+  for (;;)
+    {
+      struct reclaim_job *job;
+
+      lock_acquire (&reclaim_lock);
+      while (list_empty (&reclaim_list))
+        cond_wait (&reclaim_cond, &reclaim_lock);
+      job = list_entry (list_pop_front (&reclaim_list),
+                        struct reclaim_job, elem);
+      lock_release (&reclaim_lock);
+
+      reclaim (job);
+      free (job);
+
+      lock_acquire (&reclaim_lock);
+      if (--reclaim_pending == 0)
+        cond_broadcast (&reclaim_done, &reclaim_lock);
+      lock_release (&reclaim_lock);
     }
-  
-  return success;
 }
 
-/*
- * fill unalloced blocks with zero blocks up to 
- * the indexes provided
- */
+/* Waits until every block handed to the reclamation thread so
+   far has been released.  Returns true if there was anything to
+   wait for, false if nothing was pending.
+   The reclamation thread drops references to shared sectors,
+   which takes refcount_lock and a journal operation.  So a
+   caller holding refcount_lock does not wait and gets false, and
+   a caller in the middle of an operation suspends it while it
+   waits, so that a commit waiting for the operation to end does
+   not hold off the reclamation thread. */
+bool
+inode_reclaim_wait (void)
+{
+  bool waited;
+  int depth;
+
+  if (refcount_held ())
+    return false;
+
+  depth = journal_suspend ();
+  lock_acquire (&reclaim_lock);
+  waited = reclaim_pending > 0;
+  while (reclaim_pending > 0)
+    cond_wait (&reclaim_done, &reclaim_lock);
+  lock_release (&reclaim_lock);
+  journal_resume (depth);
+  return waited;
+}
 
-bool fillZeros(block_sector_t sector, struct inode_disk *inode, int dir, int indir, int dIndir1, int dIndir2) {
-  bool updated = false;
-  int maxIndirInd;
-  int maxDirInd;
+/* Returns a hash value for the inode that contains E. */
+static unsigned
+inode_hash (const struct hash_elem *e, void *aux UNUSED)
+{
+  const struct inode *inode = hash_entry (e, struct inode, elem);
+  return hash_int (inode->sector);
+}
 
-  // which blocks need to be filled?
-  if(dIndir1 != -1) {
-    maxIndirInd = 128;
-    maxDirInd   = 10;
-  }
-  else if(indir != -1) {
-    maxIndirInd = indir;
-    maxDirInd = 10;
-  }
-  else {
-    maxDirInd = dir + 1;
-  }
+/* Returns true if the inode that contains A precedes the one
+   that contains B. */
+static bool
+inode_less (const struct hash_elem *a, const struct hash_elem *b,
+            void *aux UNUSED)
+{
+  return (hash_entry (a, struct inode, elem)->sector
+          < hash_entry (b, struct inode, elem)->sector);
+}
 
-  // allocated temp buffer (bounce sorta)
-  block_sector_t* blocks = malloc(sizeof(block_sector_t) * 128);
-  if(blocks == NULL) {
-    PANIC("Ran out of heap for fillZeros");
-  }
+/* Makes inode_create() produce inodes in FORMAT from now on. */
+void
+inode_set_format (enum inode_format format)
+{
+  new_inode_magic = format == INODE_EXTENTS ? INODE_EXTENT_MAGIC : INODE_MAGIC;
+}
 
-  // fill direct
-  for(int i = 0; i < maxDirInd; i++) {
-    if(inode->direct[i] == 0xFFFFFFFF) {
-      if(free_map_allocate (1, &inode->direct[i])) {	  
-	updated = true;
-      }
-      else {
-	free(blocks);
-	return false;
-      }
-    }
-  }
-  if(updated) {
-    block_write (fs_device, sector, inode);
-  }
+/* Makes inode_create() produce inodes in the same format as the
+   existing inode at SECTOR. */
+void
+inode_inherit_format (block_sector_t sector)
+{
+  struct inode_disk *disk_inode = malloc (sizeof *disk_inode);
+  if (disk_inode == NULL)
+    PANIC ("Heap ran out of space and couldnt allocate for inode buffer");
+  cache_read (sector, disk_inode);
+  new_inode_magic = (disk_inode->magic == INODE_EXTENT_MAGIC
+                     ? INODE_EXTENT_MAGIC : INODE_MAGIC);
+  free (disk_inode);
+}
 
-  // fill indirect
-  updated = false;
-  if(maxIndirInd > 0) {
-    if(inode->indirect == 0xFFFFFFFF) {
-      if(free_map_allocate (1, &inode->indirect)) {	  	
-	block_write (fs_device, sector, inode);
-	// unalloced blocks must be nulled
-	fillSector(inode->indirect);
-      }
-      else {
-	free(blocks);
-	return false;
-      }
-    }
-    block_read(fs_device, inode->indirect, blocks);
-  }
-  
-  for (int i = 0; i < maxIndirInd; i++) {
-    if(blocks[i] == 0xFFFFFFFF || blocks[i] == 0) {
-      if(free_map_allocate (1, &blocks[i])) {
-	updated = true;
-      }
-    }
-  }
-  
-  if(updated) {
-    block_write (fs_device, inode->indirect, blocks);
-  }
+/* Returns true if SECTOR holds an on-disk inode of type TYPE, in
+   either layout.  A file system formatted by an older kernel may
+   use a sector that newer ones reserve for something else. */
+bool
+inode_check (block_sector_t sector, enum inode_type type)
+{
+  struct inode_disk *disk_inode = malloc (sizeof *disk_inode);
+  bool valid;
+
+  if (disk_inode == NULL)
+    PANIC ("Heap ran out of space and couldnt allocate for inode buffer");
+  cache_read (sector, disk_inode);
+  valid = ((disk_inode->magic == INODE_MAGIC
+            || disk_inode->magic == INODE_EXTENT_MAGIC)
+           && disk_inode->type == (uint32_t) type);
+  free (disk_inode);
+  return valid;
+}
+
+/* Initializes an inode with LENGTH bytes of data and
+   writes the new inode to sector SECTOR on the file system
+   device.
+   Returns true if successful.
+   Returns false if memory or disk allocation fails. */
+bool
+inode_create (block_sector_t sector, off_t length, enum inode_type type)
+{
+  struct inode_disk *disk_inode = NULL;
+  bool success = false;
 
-  // fill double indirect
-  
-  // check first level indir page
-  if(dIndir1 > 0) {
-    if(inode->doubleIndirect == 0xFFFFFFFF) {
-      if(free_map_allocate(1, &inode->doubleIndirect)) {
-	block_write (fs_device, sector, inode);
-	// unalloced blocks must be nulled
-	fillSector(inode->doubleIndirect);
-      }
-      else {
-	return false;
-      }
-    }
-  }
-  
-  for (int i = 0; i < dIndir1; i++) {
-    updated = false;
-    // read level 1 sector
-    block_read(fs_device, inode->doubleIndirect, blocks);
-    block_sector_t curBlock = blocks[i];
-
-    if(curBlock == 0xFFFFFFFF) {
-      if(free_map_allocate (1, &blocks[i])) {
-	block_write (fs_device, inode->doubleIndirect, blocks);
-	curBlock = blocks[i];
-	
-	// unalloced blocks must be nulled
-	fillSector(curBlock);
-      }
-      else {
-	free(blocks);
-	return false;
-      }
+  ASSERT (length >= 0);
+
+  /* If this assertion fails, the inode structure is not exactly
+     one sector in size, and you should fix that. */
+  ASSERT (sizeof *disk_inode == BLOCK_SECTOR_SIZE);
+
+  disk_inode = calloc (1, sizeof *disk_inode);
+  if (disk_inode != NULL && new_inode_magic == INODE_EXTENT_MAGIC)
+    {
+      disk_inode->length = length;
+      disk_inode->type   = type;
+      disk_inode->magic  = INODE_EXTENT_MAGIC;
+      disk_inode->extent_cnt   = 0;
+      disk_inode->extent_index = 0xFFFFFFFF;
     }
-    ASSERT(curBlock != 0xFFFFFFFF);
-    
-    block_read(fs_device, curBlock, blocks);
-    for(int j = 0; j < 128; j++) {
-      if(blocks[j] == 0xFFFFFFFF || blocks[j] == 0) {
-	if(free_map_allocate (1, &blocks[j])) {
-	  updated = true;
-	}
-	else {
-	  free(blocks);
-	  return false;
-	}
+  else if (disk_inode != NULL)
+    {
+      disk_inode->length = length;
+      disk_inode->type   = type;
+      disk_inode->magic  = INODE_MAGIC;
+      disk_inode->indirect       = 0xFFFFFFFF;
+      disk_inode->doubleIndirect = 0xFFFFFFFF;
+      for(int i = 0; i < 10; i++) {
+	disk_inode->direct[i] = 0xFFFFFFFF;
       }
     }
-    
-    if(updated) {
-      block_write (fs_device, curBlock, blocks);
-    }
-  }
 
-  // update last double indirect page
-  updated = false;
-  if(dIndir1 >= 0) {
-    block_read(fs_device, inode->doubleIndirect, blocks);
-    block_sector_t curBlock = blocks[dIndir1];
-    ASSERT(curBlock != 0xFFFFFFFF);
-  
-    block_read(fs_device, curBlock, blocks);
-    for(int i = 0; i < dIndir2; i++) {
-      if(blocks[i] == 0xFFFFFFFF || blocks[i] == 0) {
-	if(free_map_allocate (1, &blocks[i])) {
-	  updated = true;
-	}
-	else {
-	  free(blocks);
-	  return false;
-	}
-      }
+  /* Small inodes start out with their (zeroed) data inline and
+     take no sectors besides their own. */
+  if (disk_inode != NULL && length <= INODE_INLINE_MAX)
+    {
+      disk_inode->flags = INODE_INLINE;
+      cache_write_meta (sector, disk_inode);
+      success = true;
     }
-  
-    if(updated) {
-      block_write (fs_device, curBlock, blocks);
+  else if (disk_inode != NULL && disk_inode->magic == INODE_EXTENT_MAGIC)
+    success = extent_create (sector, disk_inode);
+  else if (disk_inode != NULL)
+    {
+      success = inode_disk_grow (disk_inode, sector, 0,
+                                 bytes_to_sectors (length));
+      if(success) {
+	cache_write_meta (sector, disk_inode);
+      }
     }
-  }
+  free (disk_inode);
   
-  free(blocks);
-  return true;
+  return success;
 }
 
 /* Reads an inode from SECTOR
@@ -317,37 +1395,75 @@ bool fillZeros(block_sector_t sector, struct inode_disk *inode, int dir, int ind
 struct inode *
 inode_open (block_sector_t sector)
 {
-  struct list_elem *e;
+  struct inode key;
+  struct hash_elem *e;
   struct inode *inode;
-
-  /* Check whether this inode is already open. */
-  for (e = list_begin (&open_inodes); e != list_end (&open_inodes);
-       e = list_next (e))
+  bool success;
+
+  /* Check whether this inode is already open.  One that is still
+     being read in or written back may yet leave the table, so
+     wait for it and then look again. */
+  lock_acquire (&open_inodes_lock);
+  key.sector = sector;
+  while ((e = hash_find (&open_inodes, &key.elem)) != NULL)
     {
-      inode = list_entry (e, struct inode, elem);
-      if (inode->sector == sector)
+      inode = hash_entry (e, struct inode, elem);
+      if (!inode->busy)
         {
-          inode_reopen (inode);
+          inode->open_cnt++;
+          lock_release (&open_inodes_lock);
           return inode;
         }
+      cond_wait (&open_inodes_cond, &open_inodes_lock);
     }
 
   /* Allocate memory. */
   inode = malloc (sizeof *inode);
   if (inode == NULL)
-    return NULL;
+    {
+      lock_release (&open_inodes_lock);
+      return NULL;
+    }
 
-  /* Initialize. */
-  list_push_front (&open_inodes, &inode->elem);
+  /* Initialize.  The inode enters the table busy, so that a
+     concurrent opener waits for its contents without the table
+     staying locked while they are read. */
   inode->sector = sector;
   inode->open_cnt = 1;
+  inode->busy = true;
+  inode->dirty = false;
   inode->deny_write_cnt = 0;
   inode->removed = false;
-  lock_init(&inode->writeLock);
-  cond_init(&inode->readCond);
-  inode->countReaders = 0;
-  inode->countWriters = 0;
-  block_read (fs_device, inode->sector, &inode->data);
+  rwlock_init (&inode->rw);
+  rwlock_init (&inode->dir_lock);
+  lock_init (&inode->map_lock);
+  inode->indirect_map = NULL;
+  inode->dindirect_map = NULL;
+  for (int i = 0; i < INODE_MAP_SLOTS; i++) {
+    inode->maps[i].index = -1;
+    inode->maps[i].entries = NULL;
+  }
+  inode->map_next = 0;
+  inode->extents = NULL;
+  inode->extent_cnt = 0;
+  hash_insert (&open_inodes, &inode->elem);
+  lock_release (&open_inodes_lock);
+
+  cache_read (inode->sector, &inode->data);
+  success = inode->data.magic != INODE_EXTENT_MAGIC || extent_load (inode);
+
+  lock_acquire (&open_inodes_lock);
+  if (success)
+    inode->busy = false;
+  else
+    hash_delete (&open_inodes, &inode->elem);
+  cond_broadcast (&open_inodes_cond, &open_inodes_lock);
+  lock_release (&open_inodes_lock);
+
+  if (!success) {
+    free (inode);
+    return NULL;
+  }
   return inode;
 }
 
@@ -356,9 +1472,9 @@ struct inode *
 inode_reopen (struct inode *inode)
 {
   if (inode != NULL) {
-    lock_acquire(&inode->writeLock);
+    lock_acquire (&open_inodes_lock);
     inode->open_cnt++;
-    lock_release(&inode->writeLock);
+    lock_release (&open_inodes_lock);
   }
   return inode;
 }
@@ -381,79 +1497,43 @@ inode_close (struct inode *inode)
     return;
 
   /* Release resources if this was the last opener. */
+  lock_acquire (&open_inodes_lock);
   if (--inode->open_cnt == 0)
     {
-      /* Remove from inode list and release lock. */
-      list_remove (&inode->elem);
-
-      block_write (fs_device, inode->sector, &inode->data);
-
-      /* Deallocate blocks if removed. */
-      if (inode->removed) {
-          free_map_release (inode->sector, 1);
-	  
-	  // iterate tables and release the blocks
-	  // first direct 
-	  for (int i = 0; i < 10; i++) {
-	    if(inode->data.direct[i] != 0xFFFFFFFF) {
-	      free_map_release (inode->data.direct[i], 1);
-	    }
-	    else {
-	      free (inode);
-	      return;
-	    }
-	  }
-
-	  // check if any indirect exist
-	  if(inode->data.indirect == 0xFFFFFFFF) {
-	    free (inode);
-	    return;
-	  }
-
-	  // iterate over indirects
-	  block_sector_t* blocks = malloc(sizeof(block_sector_t) * 128);
-	  if(!blocks) {
-	    PANIC("Heap ran out of space and couldnt allocate for indirect block buffer");
-	  }
-	  block_read(fs_device, inode->data.indirect, blocks);
-	  
-	  for (int i = 0; i < 128; i++) {
-	    if(blocks[i] != 0xFFFFFFFF) {
-	      free_map_release (blocks[i], 1);
-	    }
-	    else {
-	      free (inode);
-	      free(blocks);
-	      return;
-	    }
-	  }
-
-	  // iterate over double indirect
-	  block_sector_t* secondBlocks = malloc(sizeof(block_sector_t) * 128);
-	  if(!blocks) {
-	    PANIC("Heap ran out of space and couldnt allocate for indirect block buffer");
-	  }
-	  block_read(fs_device, inode->data.doubleIndirect, blocks);
-	  
-	  for (int i = 0; i < 128; i++) {
-	    block_read(fs_device, blocks[i], secondBlocks);
-	    for (int j = 0; j < 128; j++) {
-	      if(secondBlocks[j] != 0xFFFFFFFF) {
-		free_map_release (secondBlocks[j], 1);
-	      }
-	      else {
-		free(blocks);
-		free(secondBlocks);
-		free (inode);
-		return;
-	      }
-	    }
-	  }
-	  free(blocks);
-	  free(secondBlocks);
+      /* Write the inode back before it leaves the table, so that
+         the next opener reads its final contents.  It stays in
+         the table busy meanwhile, which makes openers wait for it
+         without the table staying locked. */
+      inode->busy = true;
+      lock_release (&open_inodes_lock);
+      invalidate_maps (inode);
+      write_back (inode);
+
+      lock_acquire (&open_inodes_lock);
+      hash_delete (&open_inodes, &inode->elem);
+      cond_broadcast (&open_inodes_cond, &open_inodes_lock);
+      lock_release (&open_inodes_lock);
+
+      /* A removed directory takes its index with it. */
+      if (inode->removed && inode->data.index != 0) {
+        struct inode *index = inode_open (inode->data.index);
+        if (index != NULL) {
+          inode_remove (index);
+          inode_close (index);
+        }
+      }
+
+      /* Deallocate blocks if removed, in the background, since
+         that means reading every index block. */
+      if (inode->removed)
+        reclaim_later (inode, 0, 0, 0);
+      else {
+        free (inode->extents);
+        free (inode);
       }
-      free (inode);
     }
+  else
+    lock_release (&open_inodes_lock);
 }
 
 /* Marks INODE to be deleted when it is closed by the last caller who
@@ -487,162 +1567,23 @@ void offset_to_arrIndex(off_t off, int* dirInd, int* indirOff, int* dIndirOff1,
   }
 }
 
-/*
- * Adds a single sector to inode_disk. called when a write goes beyond the length of the inode
- */
-
-bool inode_disk_add_sector(block_sector_t sector, struct inode_disk *inode, off_t offset) {
-  int direct, indirect, doubleIndir1, doubleIndir2;
-  offset_to_arrIndex(offset, &direct, &indirect, &doubleIndir1, &doubleIndir2);
-  
-  if(direct != -1) {
-    // add sector to direct array
-
-    // get a free sector
-    if(free_map_allocate (1, &inode->direct[direct])) {
-      // update the metadata on disk 
-      block_write (fs_device, sector, inode);
-      if(!fillZeros(sector, inode, direct, -1, -1, -1)) {
-	return false;
-      }
-      return true;
-    }
-    else {
-      return false;
-    }
-  }
-  else if(indirect != -1) {
-    // add sector to single indirect array
-
-    // create the single indirect list if it doesnt exist
-    if(inode->indirect == 0xFFFFFFFF) {
-      
-      if(free_map_allocate (1, &inode->indirect)) {
-	// update the metadata on disk 
-	block_write (fs_device, sector, inode);
-	
-	// ensure that unalloced blocks are marked as unalloced
-	block_sector_t* blocks = malloc(sizeof(block_sector_t) * 128);
-	memset(blocks, 0xFF, sizeof(block_sector_t) * 128);
-	block_write (fs_device, inode->indirect, blocks);
-	free(blocks);
-
-      }
-      else {
-	return false;
-      }
-      
-    }
-
-    block_sector_t newBlock;
-    block_sector_t* blocks = malloc(sizeof(block_sector_t) * 128);
-    if(!blocks) {
-      PANIC("Heap ran out of space and couldnt allocate for indirect block buffer");
-    }
-    
-    // get a free sector
-    if(free_map_allocate (1, &newBlock)) {
-      // update the metadata on disk
-      block_read(fs_device, inode->indirect, blocks);
-      blocks[indirect] = newBlock;
-      block_write (fs_device, inode->indirect, blocks);
-      if(!fillZeros(sector, inode, -1, indirect, -1, -1)) {
-	free(blocks);
-	return false;
-      }
-      free(blocks);
-      return true;
-    }
-    else {
-      return false;
-    }
-    
-  }
-  else {
-    // add sector to double indirect array
-
-    block_sector_t firstLevelBlock;
-    block_sector_t newBlock;
-    block_sector_t* blocks = malloc(sizeof(block_sector_t) * 128);
-    if(!blocks) {
-      PANIC("Heap ran out of space and couldnt allocate for double indirect block buffer");
-    }
-    
-    // create the first level double indirect list if it doesnt exist
-    if(inode->doubleIndirect == 0xFFFFFFFF) {
-      memset(blocks, 0xFF, sizeof(block_sector_t) * 128);
-      if(free_map_allocate (1, &inode->doubleIndirect)) {
-	// update the metadata on disk 
-	block_write (fs_device, sector, inode);
-	block_write (fs_device, inode->doubleIndirect, blocks); // ensure that unalloced blocks are marked as unalloced
-      }
-      else {
-	free(blocks);
-	return false;
-      }
-    }
-
-    // create the second level double indirect list if it doesnt exist
-    block_read(fs_device, inode->doubleIndirect, blocks);  // get the first level of the table
-    firstLevelBlock = blocks[doubleIndir1]; 
-    
-    if(firstLevelBlock == 0xFFFFFFFF) {
-      block_sector_t tempBlock;
-      if(free_map_allocate (1, &tempBlock)) {
-	// update the metadata on disk
-	blocks[doubleIndir1] = tempBlock;
-	block_write (fs_device, inode->doubleIndirect, blocks);  // update the first level of the table
-	
-	// ensure that unalloced blocks are marked as unalloced
-	memset(blocks, 0xFF, sizeof(block_sector_t) * 128);
-	block_write (fs_device, tempBlock, blocks);
-      }
-      else {
-	free(blocks);
-	return false;
-      }
-    }
-    
-    // get a free sector
-    if(free_map_allocate (1, &newBlock)) {
-      // update the metadata on disk
-      block_sector_t secondLevelBlock;
-      block_read (fs_device, inode->doubleIndirect, blocks);
-      secondLevelBlock = blocks[doubleIndir1];
-      block_read (fs_device, secondLevelBlock, blocks);
-      blocks[doubleIndir2] = newBlock;
-      block_write (fs_device, secondLevelBlock, blocks);
-      if(!fillZeros(sector, inode, -1, -1, doubleIndir1, doubleIndir2)) {
-	free(blocks);
-	return false;
-      }
-      free(blocks);
-      return true;
-    }
-    else {
-      free(blocks);
-      return false;
-    }
-    
-  }
-
-  // unreachable
-  return false;
-}
-
-/* Reads SIZE bytes from INODE into BUFFER, starting at position OFFSET.
-   Returns the number of bytes actually read, which may be less
-   than SIZE if an error occurs or end of file is reached. */
-off_t
-inode_read_at (struct inode *inode, void *buffer_, off_t size, off_t offset)
+/* Reads SIZE bytes from INODE into BUFFER, starting at position
+   OFFSET, with INODE's rw lock held.  Returns the number of bytes
+   read. */
+static off_t
+read_locked (struct inode *inode, uint8_t *buffer, off_t size, off_t offset)
 {
-  uint8_t *buffer = buffer_;
   off_t bytes_read = 0;
-  uint8_t *bounce = NULL;
 
-  lock_acquire(&inode->writeLock);
-  inode->countReaders++;
-  lock_release(&inode->writeLock);
+  if (is_inline (inode))
+    {
+      if (offset >= inode_length (inode) || size <= 0)
+        return 0;
+      if (size > inode_length (inode) - offset)
+        size = inode_length (inode) - offset;
+      memcpy (buffer, inode->data.inline_data + offset, size);
+      return size;
+    }
 
   while (size > 0)
     {
@@ -660,82 +1601,136 @@ inode_read_at (struct inode *inode, void *buffer_, off_t size, off_t offset)
       if (chunk_size <= 0)
         break;
 
-      if (sector_ofs == 0 && chunk_size == BLOCK_SECTOR_SIZE)
-        {
-          /* Read full sector directly into caller's buffer. */
-          block_read (fs_device, sector_idx, buffer + bytes_read);
-        }
+      /* A hole reads back as zeros. */
+      if (is_allocated (sector_idx))
+        cache_read_at (sector_idx, buffer + bytes_read, sector_ofs, chunk_size);
       else
-        {
-          /* Read sector into bounce buffer, then partially copy
-             into caller's buffer. */
-          if (bounce == NULL)
-            {
-              bounce = malloc (BLOCK_SECTOR_SIZE);
-              if (bounce == NULL)
-                break;
-            }
-          block_read (fs_device, sector_idx, bounce);
-          memcpy (buffer + bytes_read, bounce + sector_ofs, chunk_size);
-        }
+        memset (buffer + bytes_read, 0, chunk_size);
 
       /* Advance. */
       size -= chunk_size;
       offset += chunk_size;
       bytes_read += chunk_size;
     }
-  
-  free (bounce);
-  
-  lock_acquire(&inode->writeLock);
-  inode->countReaders--;
-  lock_release(&inode->writeLock);
+  return bytes_read;
+}
+
+/* Reads SIZE bytes from INODE into BUFFER, starting at position OFFSET.
+   Returns the number of bytes actually read, which may be less
+   than SIZE if an error occurs or end of file is reached. */
+off_t
+inode_read_at (struct inode *inode, void *buffer, off_t size, off_t offset)
+{
+  off_t bytes_read;
+
+  /* Readers of one inode proceed in parallel. */
+  rwlock_acquire_read (&inode->rw);
+  bytes_read = read_locked (inode, buffer, size, offset);
+  rwlock_release_read (&inode->rw);
 
   return bytes_read;
 }
 
-/* Writes SIZE bytes from BUFFER into INODE, starting at OFFSET.
-   Returns the number of bytes actually written, which may be
-   less than SIZE if end of file is reached or an error occurs.
-   (Normally a write at end of file would extend the inode, but
-   growth is not yet implemented.) */
+/* Reads from INODE, starting at position OFFSET, into the CNT
+   buffers described by IOV in turn, taking INODE's lock once.
+   Returns the number of bytes actually read, which is less than
+   the buffers' total size only at end of file. */
 off_t
-inode_write_at (struct inode *inode, const void *buffer_, off_t size,
+inode_readv_at (struct inode *inode, const struct iovec *iov, int cnt,
                 off_t offset)
 {
-  const uint8_t *buffer = buffer_;
+  off_t bytes_read = 0;
+  int i;
+
+  rwlock_acquire_read (&inode->rw);
+  for (i = 0; i < cnt; i++)
+    {
+      off_t n = read_locked (inode, iov[i].iov_base, iov[i].iov_len,
+                             offset + bytes_read);
+      bytes_read += n;
+      if (n < (off_t) iov[i].iov_len)
+        break;
+    }
+  rwlock_release_read (&inode->rw);
+
+  return bytes_read;
+}
+
+/* Queues the sectors of INODE that hold bytes START through END
+   (exclusive) for background read-ahead into the buffer cache.
+   Sectors beyond end of file are ignored. */
+void
+inode_readahead (struct inode *inode, off_t start, off_t end)
+{
+  off_t ofs;
+
+  rwlock_acquire_read (&inode->rw);
+  if (end > inode_length (inode))
+    end = inode_length (inode);
+  for (ofs = start - start % BLOCK_SECTOR_SIZE; ofs < end;
+       ofs += BLOCK_SECTOR_SIZE)
+    {
+      block_sector_t sector_idx = byte_to_sector (inode, ofs);
+      if (is_allocated (sector_idx))
+        cache_readahead (sector_idx);
+    }
+  rwlock_release_read (&inode->rw);
+}
+
+/* Writes SIZE bytes from BUFFER into INODE, starting at OFFSET,
+   with INODE's rw lock held for writing, growing INODE as needed.
+   Marks INODE dirty if its on-disk inode must be written back.
+   Returns the number of bytes written, which is less than SIZE
+   only if the disk is full. */
+static off_t
+write_locked (struct inode *inode, const uint8_t *buffer, off_t size,
+              off_t offset)
+{
   off_t bytes_written = 0;
-  uint8_t *bounce = NULL;
-  bool changedInode = false;
-  
-  if(inode->data.type == FILE) {
-    lock_acquire(&inode->writeLock);
+  off_t old_length = inode->data.length;
+  /* Directories, directory indexes and the free map are metadata,
+     which goes through the journal. */
+  bool meta = inode->data.type != FILE || inode->sector == FREE_MAP_SECTOR;
+
+  /* Inline data stays inline while it fits, and otherwise moves
+     to a sector before the write proceeds as usual.  Bytes past
+     the end of inline data are always zero. */
+  if (is_inline (inode)) {
+    if (offset + size <= INODE_INLINE_MAX) {
+      memcpy (inode->data.inline_data + offset, buffer, size);
+      if (offset + size > inode->data.length)
+        inode->data.length = offset + size;
+      inode->dirty = true;
+      return size;
+    }
+    if (!inline_to_blocks (inode))
+      return 0;
   }
-  inode->countWriters++;
 
-  
   if(offset + size > inode->data.length) {
     inode->data.length += offset + size - inode->data.length;    
-    changedInode = true;
-  }
-
-  if (inode->deny_write_cnt) {
-    lock_release(&inode->writeLock);
-    return 0;
+    inode->dirty = true;
   }
 
   while (size > 0) {
     /* Sector to write, starting byte offset within sector. */
     block_sector_t sector_idx = byte_to_sector (inode, offset);
-    if(sector_idx == 0xFFFFFFFF || sector_idx == 0) {
-      if(!inode_disk_add_sector(inode->sector, &inode->data, offset)) {
-	if(inode->data.type == FILE) {
-	  lock_release(&inode->writeLock);
-	}
-	return 0;
+    if(!is_allocated (sector_idx)) {
+      if(!inode_grow(inode, offset, offset + size)) {
+	/* Out of space: keep only what was written. */
+	inode->data.length = old_length > offset ? old_length : offset;
+	break;
       }
       sector_idx = byte_to_sector (inode, offset);
-      changedInode = true;
+    }
+    else if (!meta && is_shared (inode, sector_idx)) {
+      /* A sector shared with a clone is copied before it changes. */
+      sector_idx = unshare_sector (inode, offset / BLOCK_SECTOR_SIZE,
+                                   sector_idx);
+      if (!is_allocated (sector_idx)) {
+	inode->data.length = old_length > offset ? old_length : offset;
+	break;
+      }
     }
     int sector_ofs = offset % BLOCK_SECTOR_SIZE;
 
@@ -749,59 +1744,383 @@ inode_write_at (struct inode *inode, const void *buffer_, off_t size,
     if (chunk_size <= 0)
       break;
 
-    if (sector_ofs == 0 && chunk_size == BLOCK_SECTOR_SIZE)
-      {
-	/* Write full sector directly to disk. */
-	block_write (fs_device, sector_idx, buffer + bytes_written);
-      }
+    /* A partial write merges with the sector's existing contents
+       in the buffer cache. */
+    if (meta)
+      cache_write_meta_at (sector_idx, buffer + bytes_written, sector_ofs,
+                           chunk_size);
     else
-      {
-	/* We need a bounce buffer. */
-	if (bounce == NULL)
-	  {
-	    bounce = malloc (BLOCK_SECTOR_SIZE);
-	    if (bounce == NULL)
-	      break;
-	  }
-
-	/* If the sector contains data before or after the chunk
-	   we're writing, then we need to read in the sector
-	   first.  Otherwise we start with a sector of all zeros. */
-	if (sector_ofs > 0 || chunk_size < sector_left)
-	  block_read (fs_device, sector_idx, bounce);
-	else
-	  memset (bounce, 0, BLOCK_SECTOR_SIZE);
-	memcpy (bounce + sector_ofs, buffer + bytes_written, chunk_size);
-	block_write (fs_device, sector_idx, bounce);
-      }
+      cache_write_at (sector_idx, buffer + bytes_written, sector_ofs,
+                      chunk_size);
 
     /* Advance. */
     size -= chunk_size;
     offset += chunk_size;
     bytes_written += chunk_size;
   }
+  return bytes_written;
+}
+
+/* Writes SIZE bytes from BUFFER into INODE, starting at OFFSET.
+   Returns the number of bytes actually written, which may be
+   less than SIZE if the disk fills up or writes are denied.
+   Writing past end of file extends the inode. */
+off_t
+inode_write_at (struct inode *inode, const void *buffer, off_t size,
+                off_t offset)
+{
+  struct iovec iov;
+
+  iov.iov_base = (void *) buffer;
+  iov.iov_len = size;
+  return inode_writev_at (inode, &iov, 1, offset);
+}
+
+/* Writes the CNT buffers described by IOV in turn into INODE,
+   starting at OFFSET, taking INODE's lock and writing back its
+   on-disk inode only once.  Returns the number of bytes actually
+   written, as inode_write_at(). */
+off_t
+inode_writev_at (struct inode *inode, const struct iovec *iov, int cnt,
+                 off_t offset)
+{
+  off_t bytes_written = 0;
+  int i;
+  
+  /* Writers, including those that extend the inode, exclude
+     readers and each other. */
+  journal_begin ();
+  rwlock_acquire_write (&inode->rw);
 
-  if(changedInode) {
-    block_write (fs_device, inode->sector, &inode->data);
+  if (inode->deny_write_cnt) {
+    rwlock_release_write (&inode->rw);
+    journal_end ();
+    return 0;
   }
-  inode->countWriters--;
-  if(inode->data.type == FILE) {
-    lock_release(&inode->writeLock);
+
+  for (i = 0; i < cnt; i++) {
+    off_t n = write_locked (inode, iov[i].iov_base, iov[i].iov_len,
+                            offset + bytes_written);
+    bytes_written += n;
+    if (n < (off_t) iov[i].iov_len)
+      break;
   }
-  
-  free (bounce);
+
+  write_back (inode);
+  rwlock_release_write (&inode->rw);
+  journal_end ();
   
   return bytes_written;
 }
 
+/* Copies SIZE bytes of SRC starting at SRC_OFS into DST starting at
+   DST_OFS, without passing the data through a caller's buffer.
+   The part of DST being written is allocated up front in one go,
+   and the copy proceeds a destination sector at a time so that
+   whole sectors overwrite the cache without first being read.
+   SRC and DST may be the same inode if the ranges do not overlap.
+   Returns the number of bytes copied, which is less than SIZE if
+   SRC ends first or the disk fills up, or -1 if the ranges
+   overlap. */
+off_t
+inode_copy_range (struct inode *src, off_t src_ofs,
+                  struct inode *dst, off_t dst_ofs, off_t size)
+{
+  uint8_t *buffer;
+  off_t bytes_copied = 0;
+
+  if (src == dst && src_ofs < dst_ofs + size && dst_ofs < src_ofs + size)
+    return -1;
+  buffer = malloc (BLOCK_SECTOR_SIZE);
+  if (buffer == NULL)
+    return 0;
+
+  /* Lock the inodes in sector order, so that two copies in
+     opposite directions cannot deadlock. */
+  journal_begin ();
+  if (src == dst)
+    rwlock_acquire_write (&dst->rw);
+  else if (src->sector < dst->sector)
+    {
+      rwlock_acquire_read (&src->rw);
+      rwlock_acquire_write (&dst->rw);
+    }
+  else
+    {
+      rwlock_acquire_write (&dst->rw);
+      rwlock_acquire_read (&src->rw);
+    }
+
+  if (src_ofs + size > inode_length (src))
+    size = src_ofs < inode_length (src) ? inode_length (src) - src_ofs : 0;
+  if (dst->deny_write_cnt)
+    size = 0;
+
+  /* Pre-size the destination, unless it stays inline.  On failure
+     the loop below still copies what fits. */
+  if (size > 0 && is_inline (dst) && dst_ofs + size > INODE_INLINE_MAX)
+    inline_to_blocks (dst);
+  if (size > 0 && !is_inline (dst))
+    inode_grow (dst, dst_ofs, dst_ofs + size);
+
+  while (bytes_copied < size)
+    {
+      off_t chunk = BLOCK_SECTOR_SIZE - (dst_ofs + bytes_copied) % BLOCK_SECTOR_SIZE;
+      off_t n;
+
+      if (chunk > size - bytes_copied)
+        chunk = size - bytes_copied;
+      n = read_locked (src, buffer, chunk, src_ofs + bytes_copied);
+      n = write_locked (dst, buffer, n, dst_ofs + bytes_copied);
+      bytes_copied += n;
+      if (n < chunk)
+        break;
+    }
+
+  write_back (dst);
+  rwlock_release_write (&dst->rw);
+  if (src != dst)
+    rwlock_release_read (&src->rw);
+  journal_end ();
+
+  free (buffer);
+  return bytes_copied;
+}
+
+/* Replaces *SECTOR, an index block of the indexed layout, by a
+   copy that shares the data sectors under it with the original.
+   A LEVEL 1 block lists data sectors, a LEVEL 2 block lists LEVEL
+   1 blocks.  The copy is placed near NEAR.  If the disk fills up
+   or a data sector has too many references, the rest of the copy
+   is left as holes and false is returned; what was copied can be
+   released as usual. */
+static bool
+copy_index (block_sector_t *sector, int level, block_sector_t near)
+{
+  block_sector_t *blocks = malloc (BLOCK_SECTOR_SIZE);
+  bool success = true;
+  int i;
+
+  if (blocks == NULL)
+    PANIC ("Heap ran out of space and couldnt allocate for index blocks");
+
+  cache_read (*sector, blocks);
+  if (!free_map_allocate (near, 1, sector))
+    {
+      *sector = 0xFFFFFFFF;
+      free (blocks);
+      return false;
+    }
+  for (i = 0; i < 128; i++)
+    if (!is_allocated (blocks[i]))
+      continue;
+    else if (!success)
+      blocks[i] = 0xFFFFFFFF;
+    else if (level == 1 && !refcount_share (blocks[i], 1))
+      {
+        blocks[i] = 0xFFFFFFFF;
+        success = false;
+      }
+    else if (level == 2 && !copy_index (&blocks[i], 1, near))
+      success = false;
+  cache_write_meta (*sector, blocks);
+  free (blocks);
+  return success;
+}
+
+/* Creates at SECTOR a file inode with the same contents as SRC.
+   Instead of copying SRC's data, the new inode shares SRC's data
+   sectors, which either inode copies only when it writes them;
+   only the inode and its index blocks are written now.
+   Returns false if memory or disk allocation fails, or some data
+   sector of SRC already has as many references as it can hold,
+   in which case nothing but SECTOR itself is left allocated. */
+bool
+inode_clone (struct inode *src, block_sector_t sector)
+{
+  struct inode_disk *disk_inode = malloc (sizeof *disk_inode);
+  bool success = true;
+  size_t i;
+
+  if (disk_inode == NULL)
+    return false;
+
+  /* SRC is written too, to mark its data as shared before the
+     copy inherits the mark. */
+  journal_begin ();
+  rwlock_acquire_write (&src->rw);
+  if (!is_inline (src) && (src->data.flags & INODE_SHARED) == 0)
+    {
+      src->data.flags |= INODE_SHARED;
+      src->dirty = true;
+      write_back (src);
+    }
+  memcpy (disk_inode, &src->data, sizeof *disk_inode);
+  disk_inode->index = 0;
+
+  if (is_inline (src))
+    cache_write_meta (sector, disk_inode);
+  else if (src->data.magic == INODE_EXTENT_MAGIC)
+    {
+      struct inode *dst;
+
+      /* Build the extent tree through an open inode, as
+         extent_create() does. */
+      disk_inode->extent_cnt = 0;
+      disk_inode->extent_index = 0xFFFFFFFF;
+      cache_write_meta (sector, disk_inode);
+      dst = inode_open (sector);
+      if (dst == NULL)
+        success = false;
+      else
+        {
+          struct inode_extent *extents
+            = malloc ((src->extent_cnt > 0 ? src->extent_cnt : 1)
+                      * sizeof *extents);
+
+          lock_acquire (&dst->map_lock);
+          if (extents == NULL)
+            success = false;
+          else
+            {
+              free (dst->extents);
+              dst->extents = extents;
+              for (i = 0; i < src->extent_cnt && success; i++)
+                {
+                  extents[i] = src->extents[i];
+                  if (refcount_share (extents[i].start, extents[i].length))
+                    dst->extent_cnt = i + 1;
+                  else
+                    success = false;
+                }
+              if (!extent_store (dst, 0))
+                success = false;
+            }
+          if (!success)
+            extent_release (dst);
+          lock_release (&dst->map_lock);
+          inode_close (dst);
+        }
+    }
+  else
+    {
+      for (i = 0; i < 10; i++)
+        if (is_allocated (disk_inode->direct[i])
+            && (!success || !refcount_share (disk_inode->direct[i], 1)))
+          {
+            disk_inode->direct[i] = 0xFFFFFFFF;
+            success = false;
+          }
+      if (is_allocated (disk_inode->indirect))
+        {
+          if (!success)
+            disk_inode->indirect = 0xFFFFFFFF;
+          else
+            success = copy_index (&disk_inode->indirect, 1, sector);
+        }
+      if (is_allocated (disk_inode->doubleIndirect))
+        {
+          if (!success)
+            disk_inode->doubleIndirect = 0xFFFFFFFF;
+          else
+            success = copy_index (&disk_inode->doubleIndirect, 2, sector);
+        }
+      if (success)
+        cache_write_meta (sector, disk_inode);
+      else
+        inode_disk_release (disk_inode);
+    }
+
+  rwlock_release_write (&src->rw);
+  journal_end ();
+  free (disk_inode);
+  return success;
+}
+
+/* Sets the length of INODE to LENGTH bytes.  Shrinking releases
+   the sectors past the new end through the reclamation thread;
+   growing leaves a hole that reads back as zeros.
+   Returns false if writes to INODE are denied, LENGTH is out of
+   range for INODE's layout, or the disk is too full to make the
+   change. */
+bool
+inode_truncate (struct inode *inode, off_t length)
+{
+  bool success = true;
+
+  if (length < 0)
+    return false;
+
+  journal_begin ();
+  rwlock_acquire_write (&inode->rw);
+
+  if (inode->deny_write_cnt
+      || (inode->data.magic != INODE_EXTENT_MAGIC
+          && bytes_to_sectors (length) > INDEXED_MAX_SECTORS))
+    success = false;
+  else if (is_inline (inode) && length <= INODE_INLINE_MAX)
+    {
+      if (length < inode->data.length)
+        memset (inode->data.inline_data + length, 0,
+                inode->data.length - length);
+    }
+  else if (is_inline (inode) && !inline_to_blocks (inode))
+    success = false;
+  else if (length < inode->data.length)
+    {
+      block_sector_t sector = byte_to_sector (inode, length);
+      int tail = length % BLOCK_SECTOR_SIZE;
+
+      /* Zero the rest of the last sector kept, so that growing
+         the file again does not bring old bytes back.  If a clone
+         shares that sector, it gets a copy first. */
+      if (tail != 0 && inode->data.type == FILE && is_allocated (sector)
+          && is_shared (inode, sector))
+        {
+          sector = unshare_sector (inode, length / BLOCK_SECTOR_SIZE, sector);
+          success = is_allocated (sector);
+        }
+      if (success && tail != 0 && is_allocated (sector))
+        {
+          if (inode->data.type != FILE)
+            cache_write_meta_at (sector, zeros, tail, BLOCK_SECTOR_SIZE - tail);
+          else
+            cache_write_at (sector, zeros, tail, BLOCK_SECTOR_SIZE - tail);
+        }
+
+      if (success)
+        {
+          lock_acquire (&inode->map_lock);
+          if (inode->data.magic == INODE_EXTENT_MAGIC)
+            extent_truncate (inode, bytes_to_sectors (length));
+          else
+            {
+              indexed_truncate (&inode->data, bytes_to_sectors (length));
+              invalidate_maps (inode);
+            }
+          lock_release (&inode->map_lock);
+        }
+    }
+
+  if (success)
+    {
+      inode->data.length = length;
+      inode->dirty = true;
+      write_back (inode);
+    }
+  rwlock_release_write (&inode->rw);
+  journal_end ();
+  return success;
+}
+
 /* Disables writes to INODE.
    May be called at most once per inode opener. */
 void
 inode_deny_write (struct inode *inode)
 {
-  lock_acquire(&inode->writeLock);
+  rwlock_acquire_write (&inode->rw);
   inode->deny_write_cnt++;
-  lock_release(&inode->writeLock);
+  rwlock_release_write (&inode->rw);
   ASSERT (inode->deny_write_cnt <= inode->open_cnt);
 }
 
@@ -813,9 +2132,9 @@ inode_allow_write (struct inode *inode)
 {
   ASSERT (inode->deny_write_cnt > 0);
   ASSERT (inode->deny_write_cnt <= inode->open_cnt);
-  lock_acquire(&inode->writeLock);
+  rwlock_acquire_write (&inode->rw);
   inode->deny_write_cnt--;
-  lock_release(&inode->writeLock);
+  rwlock_release_write (&inode->rw);
 }
 
 /* Returns the length, in bytes, of INODE's data. */
@@ -824,3 +2143,22 @@ inode_length (const struct inode *inode)
 {
   return inode->data.length;
 }
+
+/* Returns the sector of the inode holding INODE's directory
+   index, or 0 if INODE has none. */
+block_sector_t
+inode_get_index (const struct inode *inode)
+{
+  return inode->data.index;
+}
+
+/* Makes the inode at SECTOR INODE's directory index, or removes
+   INODE's index if SECTOR is 0, and writes INODE to disk.  The
+   index inode is removed along with INODE. */
+void
+inode_set_index (struct inode *inode, block_sector_t sector)
+{
+  inode->data.index = sector;
+  inode->dirty = true;
+  write_back (inode);
+}
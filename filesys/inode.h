@@ -2,45 +2,113 @@
 #define FILESYS_INODE_H
 
 #include <stdbool.h>
-#include <list.h>
+#include <hash.h>
 #include "filesys/off_t.h"
 #include "devices/block.h"
 #include "threads/synch.h"
 
 struct bitmap;
+struct iovec;
 
 enum inode_type{FILE=2, DIR=1, DATA=0};
 
+/* On-disk inode layouts that inode_create() can produce. */
+enum inode_format
+  {
+    INODE_INDEXED,                      /* Direct and indirect blocks. */
+    INODE_EXTENTS                       /* Runs of contiguous sectors. */
+  };
+
+/* Extents stored in the inode itself.  Further extents go to leaf
+   blocks listed in the inode's extent_index block. */
+#define INODE_INLINE_EXTENTS 8
+
+/* Files and directories of at most this many bytes keep their
+   data in the inode itself, until they grow past it. */
+#define INODE_INLINE_MAX 388
+
+/* Flags of an on-disk inode. */
+#define INODE_INLINE 0x1                /* Data is in inline_data. */
+#define INODE_SHARED 0x2                /* Data may be shared by a clone. */
+
+/* A run of LENGTH contiguous sectors starting at sector START on
+   disk, which holds the file's sectors starting at LOGICAL. */
+struct inode_extent
+  {
+    uint32_t logical;                   /* First file sector covered. */
+    block_sector_t start;               /* First disk sector. */
+    uint32_t length;                    /* Number of sectors. */
+  };
+
 /* On-disk inode.
    Must be exactly BLOCK_SECTOR_SIZE bytes long. */
 struct inode_disk
   {
     off_t length;                       /* File size in bytes. */
     uint32_t type;                      
-    unsigned magic;                     /* Magic number. */
-    block_sector_t direct[10];          /* Pointer to get to the next inode */
-    block_sector_t indirect;
-    block_sector_t doubleIndirect;
-    uint32_t unused[113];               /* Not used. */
+    unsigned magic;                     /* Magic number, selects layout. */
+    union
+      {
+        /* INODE_INDEXED layout. */
+        struct
+          {
+            block_sector_t direct[10];  /* Pointer to get to the next inode */
+            block_sector_t indirect;
+            block_sector_t doubleIndirect;
+          };
+
+        /* INODE_EXTENTS layout, sorted by logical sector. */
+        struct
+          {
+            uint32_t extent_cnt;        /* Number of extents in file. */
+            block_sector_t extent_index; /* Block of leaf sectors. */
+            struct inode_extent extents[INODE_INLINE_EXTENTS];
+          };
+      };
+    block_sector_t index;               /* Directory index inode, or 0. */
+    uint32_t flags;                     /* INODE_* flags. */
+    uint8_t inline_data[INODE_INLINE_MAX]; /* Data, if INODE_INLINE. */
+  };
+
+/* Number of second-level double-indirect blocks that an open
+   inode keeps cached in memory. */
+#define INODE_MAP_SLOTS 4
+
+/* In-memory copy of one second-level double-indirect block. */
+struct inode_map
+  {
+    int index;                          /* Entry in doubleIndirect, -1 if unused. */
+    block_sector_t *entries;            /* Copy of the block, or NULL. */
   };
 
 /* In-memory inode. */
 struct inode
   {
-    struct list_elem elem;              /* Element in inode list. */
+    struct hash_elem elem;              /* Element in open inode table. */
     block_sector_t sector;              /* Sector number of disk location. */
     int open_cnt;                       /* Number of openers. */
+    bool busy;                          /* Being read in or written back. */
+    bool dirty;                         /* DATA changed since written? */
     bool removed;                       /* True if deleted, false otherwise. */
     int deny_write_cnt;                 /* 0: writes ok, >0: deny writes. */
     struct inode_disk data;             /* Inode content. */
-    struct lock writeLock;              /* write lock */
-    struct condition readCond;          /* reading condition */
-    int countReaders;
-    int countWriters;
+    struct rwlock rw;                   /* Readers share, writers exclusive. */
+    struct rwlock dir_lock;             /* Directory entries, if a dir. */
+    struct lock map_lock;               /* Protects the cached index blocks. */
+    block_sector_t *indirect_map;       /* Copy of indirect block, or NULL. */
+    block_sector_t *dindirect_map;      /* Copy of doubleIndirect, or NULL. */
+    struct inode_map maps[INODE_MAP_SLOTS]; /* Second-level blocks. */
+    int map_next;                       /* Next slot in MAPS to replace. */
+    struct inode_extent *extents;       /* All extents, if INODE_EXTENTS. */
+    size_t extent_cnt;                  /* Number of extents in EXTENTS. */
   };
 
 void inode_init (void);
+void inode_set_format (enum inode_format);
+void inode_inherit_format (block_sector_t);
+bool inode_check (block_sector_t, enum inode_type);
 bool inode_create (block_sector_t, off_t, enum inode_type);
+bool inode_clone (struct inode *src, block_sector_t);
 struct inode *inode_open (block_sector_t);
 struct inode *inode_reopen (struct inode *);
 block_sector_t inode_get_inumber (const struct inode *);
@@ -48,8 +116,19 @@ void inode_close (struct inode *);
 void inode_remove (struct inode *);
 off_t inode_read_at (struct inode *, void *, off_t size, off_t offset);
 off_t inode_write_at (struct inode *, const void *, off_t size, off_t offset);
+off_t inode_readv_at (struct inode *, const struct iovec *, int cnt,
+                      off_t offset);
+off_t inode_writev_at (struct inode *, const struct iovec *, int cnt,
+                       off_t offset);
+off_t inode_copy_range (struct inode *src, off_t src_ofs,
+                        struct inode *dst, off_t dst_ofs, off_t size);
+void inode_readahead (struct inode *, off_t start, off_t end);
+bool inode_truncate (struct inode *, off_t length);
+bool inode_reclaim_wait (void);
 void inode_deny_write (struct inode *);
 void inode_allow_write (struct inode *);
 off_t inode_length (const struct inode *);
+block_sector_t inode_get_index (const struct inode *);
+void inode_set_index (struct inode *, block_sector_t);
 
 #endif /* filesys/inode.h */
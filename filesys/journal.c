@@ -0,0 +1,693 @@
+#include "filesys/journal.h"
+#include <bitmap.h>
+#include <debug.h>
+#include <hash.h>
+#include <list.h>
+#include <stdio.h>
+#include <string.h>
+#include "filesys/cache.h"
+#include "filesys/filesys.h"
+#include "filesys/free-map.h"
+#include "threads/malloc.h"
+#include "threads/synch.h"
+#include "threads/thread.h"
+
+/* Metadata journal.
+
+   Inode sectors, index blocks, directory contents, and the free
+   map file are written with cache_write_meta(), which marks the
+   cached sector as part of the running transaction and keeps it
+   from reaching its home location.  journal_commit() writes all
+   of them to the log as one transaction, a descriptor block
+   listing their home sectors, then the sectors themselves, then
+   a commit block with a checksum over them, in one sequential
+   run.  Only then may the buffer cache write them home, which it
+   does lazily like any other dirty sector.  A sector changed many
+   times between commits is logged once.
+
+   Transactions are appended to the log until it is nearly full.
+   Then every dirty sector is written home and the header is reset
+   to start the log over ("checkpoint").  A logged sector that has
+   changed again in the running transaction cannot be written
+   home from the cache, so its last logged copy is copied home
+   from the log instead.  At boot,
+   journal_recover() replays every complete transaction logged
+   since the last checkpoint, in order, so that the file system
+   reflects either all of a transaction or none of it.
+
+   Replay writes logged copies home without regard to what became
+   of the sectors afterward.  So a sector freed while recovery
+   might still replay a copy of it is held back from allocation
+   (see journal_hold()) until a checkpoint that follows the commit
+   of the transaction that freed it; by then no copy remains in
+   the log and the free is on disk.
+
+   File system operations bracket their metadata changes with
+   journal_begin() and journal_end().  journal_commit() waits for
+   the operations in progress to end and holds off new ones, so
+   that a transaction never holds half of an operation.  To keep
+   it that way when a transaction fills up, each operation
+   reserves room in the running transaction for OP_CREDITS sectors
+   when it begins, and an operation that finds no room commits the
+   transaction first, before it takes any lock that others in
+   progress might be waiting for.  An operation that changes more
+   sectors than it reserved takes what room is left and then grows
+   the transaction past its usual size.  Only if the operations in
+   progress overrun their reservations by as much again does the
+   transaction have to be committed partway through them.
+
+   File data is not journaled, but a sector newly allocated to a
+   file is written to disk before the transaction that makes it
+   part of the file commits, so that a crash cannot leave the file
+   showing whatever the sector held before. */
+
+/* Identify the header, descriptor, and commit blocks. */
+#define HEADER_MAGIC 0x4a524e4c
+#define DESC_MAGIC 0x4a444553
+#define COMMIT_MAGIC 0x4a434d54
+
+/* Sectors in the log proper, which follows the header. */
+#define LOG_SECTORS (JOURNAL_SECTORS - 1)
+
+/* Entry in log_home[] for a descriptor or commit block. */
+#define NO_HOME ((block_sector_t) -1)
+
+/* Most sectors a descriptor block can list. */
+#define TXN_MAX 125
+
+/* Sectors an operation reserves in the running transaction.
+   Creating or removing a file, or a write that grows one by a
+   few index blocks, changes no more than this. */
+#define OP_CREDITS 8
+
+/* Journal header, at JOURNAL_SECTOR. */
+struct journal_header
+  {
+    unsigned magic;                     /* HEADER_MAGIC. */
+    uint32_t seq;                       /* Sequence number of first txn. */
+    uint32_t start;                     /* Log offset of first txn. */
+    uint32_t unused[125];               /* Not used. */
+  };
+
+/* First block of a transaction. */
+struct journal_desc
+  {
+    unsigned magic;                     /* DESC_MAGIC. */
+    uint32_t seq;                       /* Transaction sequence number. */
+    uint32_t cnt;                       /* Number of logged sectors. */
+    block_sector_t sectors[TXN_MAX];    /* Home of each logged sector. */
+  };
+
+/* Last block of a transaction. */
+struct journal_commit
+  {
+    unsigned magic;                     /* COMMIT_MAGIC. */
+    uint32_t seq;                       /* Same as the descriptor's. */
+    uint32_t cnt;                       /* Same as the descriptor's. */
+    unsigned checksum;                  /* Over the logged sectors. */
+    uint32_t unused[124];               /* Not used. */
+  };
+
+/* True if the file system has a journal. */
+static bool active;
+
+/* Sectors changed in the running transaction, the most that it
+   holds before new operations wait for it to be committed, and
+   the most that it may hold at all. */
+static block_sector_t txn[TXN_MAX];
+static size_t txn_cnt;
+static size_t txn_max;
+static size_t txn_limit;
+
+/* Sectors that operations in progress have reserved in the
+   running transaction but not yet changed, and the number that
+   each operation reserves. */
+static size_t txn_reserved;
+static size_t op_credits;
+
+/* Sequence number the running transaction will be committed
+   with. */
+static uint32_t txn_seq;
+
+/* Sectors that recovery might overwrite with a logged copy: those
+   logged since the last checkpoint, being committed, or changed
+   in the running transaction. */
+static struct bitmap *logged;
+
+/* A sector freed while in LOGGED, which the free map holds back
+   until a checkpoint follows the commit of transaction SEQ. */
+struct held_sector
+  {
+    struct list_elem elem;              /* Element in a list below. */
+    block_sector_t sector;              /* Sector freed. */
+    uint32_t seq;                       /* Transaction that freed it. */
+  };
+static struct list held_list;           /* Waiting for a checkpoint. */
+static struct list unheld_list;         /* To hand back to the free map. */
+
+/* Operations in progress, and whether journal_commit() is
+   waiting for them to end. */
+static int handle_cnt;
+static bool quiescing;
+
+/* Protects the variables above. */
+static struct lock journal_lock;
+static struct condition handles_done;   /* handle_cnt reached 0. */
+static struct condition quiesce_done;   /* quiescing became false. */
+
+/* Log state.  Protected by commit_lock, which also serializes
+   writes to the log. */
+static struct journal_header header;
+static uint32_t log_end;                /* Log offset of next txn. */
+static uint32_t next_seq;               /* Sequence number of next txn. */
+static block_sector_t log_home[LOG_SECTORS]; /* Home of each logged copy. */
+static struct lock commit_lock;
+
+/* Statistics. */
+static unsigned long long commit_cnt;   /* Transactions committed. */
+static unsigned long long logged_cnt;   /* Sectors logged. */
+
+static void commit_txn (void);
+static void checkpoint (const block_sector_t *pending, size_t cnt);
+static void reset_log (void);
+static void forget_log (const block_sector_t *pending, size_t cnt);
+static void release_held (void);
+static bool replay_txn (uint32_t pos, uint32_t seq, uint32_t *cntp);
+
+/* Returns the disk sector at offset POS in the log. */
+static inline block_sector_t
+log_sector (uint32_t pos)
+{
+  ASSERT (pos < LOG_SECTORS);
+  return JOURNAL_SECTOR + 1 + pos;
+}
+
+/* Initializes the journal module.  The journal stays inactive
+   until journal_create() or journal_recover() finds it. */
+void
+journal_init (void)
+{
+  lock_init (&journal_lock);
+  cond_init (&handles_done);
+  cond_init (&quiesce_done);
+  lock_init (&commit_lock);
+  list_init (&held_list);
+  list_init (&unheld_list);
+  logged = bitmap_create (block_size (fs_device));
+  if (logged == NULL)
+    PANIC ("journal: can't allocate logged sector map");
+
+  /* Logged sectors cannot be evicted.  A transaction usually
+     holds up to a quarter of the buffer cache, and at most half,
+     which leaves room for the operations still in progress to go
+     on while it commits. */
+  txn_max = cache_size () / 4;
+  if (txn_max > TXN_MAX)
+    txn_max = TXN_MAX;
+  if (txn_max < 1)
+    txn_max = 1;
+  txn_limit = 2 * txn_max < TXN_MAX ? 2 * txn_max : TXN_MAX;
+  op_credits = OP_CREDITS < txn_max ? OP_CREDITS : txn_max;
+  active = false;
+}
+
+/* Writes an empty journal for a newly formatted file system and
+   starts logging to it. */
+void
+journal_create (void)
+{
+  static char zeros[BLOCK_SECTOR_SIZE];
+
+  memset (&header, 0, sizeof header);
+  header.magic = HEADER_MAGIC;
+  header.seq = 0;
+  header.start = 0;
+  block_write (fs_device, JOURNAL_SECTOR, &header);
+
+  /* Don't let recovery find a transaction left by an earlier
+     file system on the same disk. */
+  block_write (fs_device, log_sector (0), zeros);
+
+  log_end = 0;
+  next_seq = txn_seq = 0;
+  active = true;
+}
+
+/* Replays the transactions committed since the last checkpoint
+   and starts logging.  Leaves the journal inactive if the file
+   system has none.  Must be called before anything else reads
+   the file system. */
+void
+journal_recover (void)
+{
+  uint32_t pos, seq, cnt;
+  size_t replayed = 0;
+
+  block_read (fs_device, JOURNAL_SECTOR, &header);
+  if (header.magic != HEADER_MAGIC || header.start >= LOG_SECTORS)
+    return;
+
+  pos = header.start;
+  seq = header.seq;
+  while (pos < LOG_SECTORS && replay_txn (pos, seq, &cnt))
+    {
+      pos += cnt + 2;
+      seq++;
+      replayed++;
+    }
+  if (replayed > 0)
+    printf ("journal: replayed %zu transactions.\n", replayed);
+
+  /* Everything replayed is home now. */
+  next_seq = txn_seq = seq;
+  reset_log ();
+  active = true;
+}
+
+/* Commits the running transaction, writes everything home, and
+   stops logging, so that the next boot has nothing to replay. */
+void
+journal_close (void)
+{
+  if (!active)
+    return;
+
+  journal_commit ();
+  lock_acquire (&commit_lock);
+  active = false;
+  cache_flush ();
+  reset_log ();
+  forget_log (NULL, 0);
+  lock_release (&commit_lock);
+  release_held ();
+}
+
+/* Prints journal statistics. */
+void
+journal_print_stats (void)
+{
+  printf ("Journal: %llu transactions, %llu sectors logged\n",
+          commit_cnt, logged_cnt);
+}
+
+/* Returns true if metadata changes are being journaled. */
+bool
+journal_active (void)
+{
+  return active;
+}
+
+/* Begins a file system operation and reserves room for it in
+   the running transaction, waiting while a commit is holding off
+   new operations.  If the transaction has no room left, commits
+   it first.  Must be called before taking any file system lock.
+   Operations nest: only the outermost journal_begin() and
+   journal_end() of a thread count. */
+void
+journal_begin (void)
+{
+  struct thread *t = thread_current ();
+
+  if (t->journal_depth > 0)
+    {
+      t->journal_depth++;
+      return;
+    }
+
+  lock_acquire (&journal_lock);
+  for (;;)
+    {
+      if (quiescing)
+        cond_wait (&quiesce_done, &journal_lock);
+      else if (active && txn_cnt + txn_reserved + op_credits > txn_max)
+        {
+          lock_release (&journal_lock);
+          journal_commit ();
+          lock_acquire (&journal_lock);
+        }
+      else
+        break;
+    }
+  handle_cnt++;
+  txn_reserved += op_credits;
+  t->journal_credits = op_credits;
+  lock_release (&journal_lock);
+  t->journal_depth = 1;
+}
+
+/* Ends a file system operation begun with journal_begin(), giving
+   back the room it reserved but did not use. */
+void
+journal_end (void)
+{
+  struct thread *t = thread_current ();
+
+  ASSERT (t->journal_depth > 0);
+  if (--t->journal_depth > 0)
+    return;
+
+  lock_acquire (&journal_lock);
+  txn_reserved -= t->journal_credits;
+  t->journal_credits = 0;
+  if (--handle_cnt == 0)
+    cond_broadcast (&handles_done, &journal_lock);
+  lock_release (&journal_lock);
+}
+
+/* Ends the current thread's operation for the time being, so
+   that a commit need not wait for it while the thread waits for
+   another thread that may itself have to begin an operation.
+   The changes made so far may then be committed apart from the
+   rest of the operation, as when a transaction fills up.
+   Returns the nesting depth to pass to journal_resume(). */
+int
+journal_suspend (void)
+{
+  struct thread *t = thread_current ();
+  int depth = t->journal_depth;
+
+  if (depth > 0)
+    {
+      t->journal_depth = 1;
+      journal_end ();
+    }
+  return depth;
+}
+
+/* Resumes the operation that journal_suspend() suspended at
+   nesting depth DEPTH, waiting while a commit holds off new
+   operations.  The operation holds locks, so unlike
+   journal_begin() this never commits, and the operation gets its
+   reservation back even if the transaction has no room for it. */
+void
+journal_resume (int depth)
+{
+  struct thread *t = thread_current ();
+
+  if (depth > 0)
+    {
+      lock_acquire (&journal_lock);
+      while (quiescing)
+        cond_wait (&quiesce_done, &journal_lock);
+      handle_cnt++;
+      txn_reserved += op_credits;
+      t->journal_credits = op_credits;
+      lock_release (&journal_lock);
+      t->journal_depth = depth;
+    }
+}
+
+/* Adds SECTOR, which the buffer cache has just marked as changed
+   in the running transaction, to that transaction, out of the
+   current operation's reservation while it lasts.  Commits the
+   transaction first if it cannot hold any more. */
+void
+journal_add (block_sector_t sector)
+{
+  struct thread *t = thread_current ();
+
+  lock_acquire (&journal_lock);
+  if (t->journal_credits > 0)
+    {
+      t->journal_credits--;
+      txn_reserved--;
+    }
+  while (txn_cnt >= txn_limit)
+    {
+      lock_release (&journal_lock);
+      commit_txn ();
+      lock_acquire (&journal_lock);
+    }
+  txn[txn_cnt++] = sector;
+  bitmap_mark (logged, sector);
+  lock_release (&journal_lock);
+}
+
+/* Called by the free map as it frees SECTOR.  Returns true if
+   recovery might still overwrite SECTOR with a copy from the
+   log, in which case the free map must not allocate it again
+   until journal_commit() hands it back through
+   free_map_unhold(). */
+bool
+journal_hold (block_sector_t sector)
+{
+  bool hold;
+
+  if (!active)
+    return false;
+
+  lock_acquire (&journal_lock);
+  hold = bitmap_test (logged, sector);
+  if (hold)
+    {
+      struct held_sector *h = malloc (sizeof *h);
+      if (h == NULL)
+        PANIC ("journal: out of memory holding freed sector");
+      h->sector = sector;
+      h->seq = txn_seq;
+      list_push_back (&held_list, &h->elem);
+    }
+  lock_release (&journal_lock);
+  return hold;
+}
+
+/* Waits for the operations in progress to end, then writes the
+   free map and commits the running transaction to the log.
+   Without a journal, just writes the free map. */
+void
+journal_commit (void)
+{
+  struct thread *t = thread_current ();
+
+  ASSERT (t->journal_depth == 0);
+  if (!active)
+    {
+      free_map_flush ();
+      return;
+    }
+
+  lock_acquire (&journal_lock);
+  while (quiescing)
+    cond_wait (&quiesce_done, &journal_lock);
+  quiescing = true;
+  while (handle_cnt > 0)
+    cond_wait (&handles_done, &journal_lock);
+  lock_release (&journal_lock);
+
+  /* Our own changes to the free map file must not wait for us. */
+  t->journal_depth++;
+  free_map_flush ();
+  commit_txn ();
+  t->journal_depth--;
+
+  lock_acquire (&journal_lock);
+  quiescing = false;
+  cond_broadcast (&quiesce_done, &journal_lock);
+  lock_release (&journal_lock);
+
+  release_held ();
+}
+
+/* Writes the running transaction to the log and lets the buffer
+   cache write its sectors home.  Checkpoints first if the
+   transaction does not fit in the log, and afterward if another
+   full one might not. */
+static void
+commit_txn (void)
+{
+  static struct journal_desc desc;
+  static struct journal_commit commit;
+  static uint8_t block[BLOCK_SECTOR_SIZE];
+  unsigned checksum = 0;
+  size_t i;
+
+  lock_acquire (&commit_lock);
+  lock_acquire (&journal_lock);
+  desc.cnt = txn_cnt;
+  memcpy (desc.sectors, txn, txn_cnt * sizeof *txn);
+  txn_cnt = 0;
+  if (desc.cnt > 0)
+    txn_seq++;
+  lock_release (&journal_lock);
+
+  if (desc.cnt == 0)
+    {
+      lock_release (&commit_lock);
+      return;
+    }
+
+  /* The sectors that the transaction makes part of files have all
+     been written to the cache by now. */
+  cache_flush_new ();
+
+  if (log_end + desc.cnt + 2 > LOG_SECTORS)
+    checkpoint (desc.sectors, desc.cnt);
+
+  /* Descriptor, sectors, and finally the commit block, which
+     makes the transaction count. */
+  desc.magic = DESC_MAGIC;
+  desc.seq = next_seq;
+  block_write (fs_device, log_sector (log_end), &desc);
+  log_home[log_end] = NO_HOME;
+  for (i = 0; i < desc.cnt; i++)
+    {
+      cache_log_snapshot (desc.sectors[i], block);
+      checksum = checksum * 31 + hash_bytes (block, sizeof block);
+      block_write (fs_device, log_sector (log_end + 1 + i), block);
+      log_home[log_end + 1 + i] = desc.sectors[i];
+    }
+  memset (&commit, 0, sizeof commit);
+  commit.magic = COMMIT_MAGIC;
+  commit.seq = next_seq;
+  commit.cnt = desc.cnt;
+  commit.checksum = checksum;
+  block_write (fs_device, log_sector (log_end + 1 + desc.cnt), &commit);
+  log_home[log_end + 1 + desc.cnt] = NO_HOME;
+
+  log_end += desc.cnt + 2;
+  next_seq++;
+  commit_cnt++;
+  logged_cnt += desc.cnt;
+  for (i = 0; i < desc.cnt; i++)
+    cache_log_done (desc.sectors[i]);
+
+  if (log_end + txn_max + 2 > LOG_SECTORS)
+    checkpoint (NULL, 0);
+  lock_release (&commit_lock);
+}
+
+/* Writes everything logged so far home and starts the log over.
+   The buffer cache holds back sectors that have changed again in
+   the running transaction, whose committed contents therefore
+   exist only in the log, so those are copied home from the log,
+   oldest copy first so that the last one wins.  The CNT sectors
+   in PENDING are about to be logged.  Must be called with
+   commit_lock held, so that no transaction is committing. */
+static void
+checkpoint (const block_sector_t *pending, size_t cnt)
+{
+  static uint8_t block[BLOCK_SECTOR_SIZE];
+  uint32_t pos;
+
+  ASSERT (lock_held_by_current_thread (&commit_lock));
+
+  if (!cache_flush ())
+    for (pos = 0; pos < log_end; pos++)
+      if (log_home[pos] != NO_HOME && cache_log_pending (log_home[pos]))
+        {
+          block_read (fs_device, log_sector (pos), block);
+          block_write (fs_device, log_home[pos], block);
+        }
+  reset_log ();
+  forget_log (pending, cnt);
+}
+
+/* Starts the log over, after everything logged so far has been
+   written home. */
+static void
+reset_log (void)
+{
+  header.seq = next_seq;
+  header.start = 0;
+  block_write (fs_device, JOURNAL_SECTOR, &header);
+  log_end = 0;
+}
+
+/* Notes that the log has been started over, so that recovery can
+   only replay the running transaction and the CNT sectors in
+   PENDING, and ends the hold on the sectors freed by transactions
+   committed before; release_held() hands those back to the free
+   map.  Must be called with commit_lock held. */
+static void
+forget_log (const block_sector_t *pending, size_t cnt)
+{
+  struct list_elem *e;
+  size_t i;
+
+  ASSERT (lock_held_by_current_thread (&commit_lock));
+
+  lock_acquire (&journal_lock);
+  bitmap_set_all (logged, false);
+  for (i = 0; i < txn_cnt; i++)
+    bitmap_mark (logged, txn[i]);
+  for (i = 0; i < cnt; i++)
+    bitmap_mark (logged, pending[i]);
+
+  for (e = list_begin (&held_list); e != list_end (&held_list); )
+    {
+      struct held_sector *h = list_entry (e, struct held_sector, elem);
+
+      e = list_next (e);
+      if (h->seq < next_seq)
+        {
+          list_remove (&h->elem);
+          list_push_back (&unheld_list, &h->elem);
+        }
+    }
+  lock_release (&journal_lock);
+}
+
+/* Hands back to the free map the sectors whose hold forget_log()
+   has ended.  Must be called without any file system lock held. */
+static void
+release_held (void)
+{
+  struct list ready;
+
+  list_init (&ready);
+  lock_acquire (&journal_lock);
+  list_splice (list_end (&ready), list_begin (&unheld_list),
+               list_end (&unheld_list));
+  lock_release (&journal_lock);
+
+  while (!list_empty (&ready))
+    {
+      struct held_sector *h = list_entry (list_pop_front (&ready),
+                                          struct held_sector, elem);
+      free_map_unhold (h->sector);
+      free (h);
+    }
+}
+
+/* Replays the transaction at log offset POS if it has sequence
+   number SEQ and was completely committed.  Returns true and
+   stores the number of sectors it logged in *CNTP if so, false
+   otherwise. */
+static bool
+replay_txn (uint32_t pos, uint32_t seq, uint32_t *cntp)
+{
+  static struct journal_desc desc;
+  static struct journal_commit commit;
+  static uint8_t block[BLOCK_SECTOR_SIZE];
+  unsigned checksum = 0;
+  uint32_t i;
+
+  block_read (fs_device, log_sector (pos), &desc);
+  if (desc.magic != DESC_MAGIC || desc.seq != seq
+      || desc.cnt == 0 || desc.cnt > TXN_MAX
+      || pos + desc.cnt + 2 > LOG_SECTORS)
+    return false;
+
+  block_read (fs_device, log_sector (pos + 1 + desc.cnt), &commit);
+  if (commit.magic != COMMIT_MAGIC || commit.seq != seq
+      || commit.cnt != desc.cnt)
+    return false;
+
+  /* A crash while writing the transaction can leave an old
+     commit block in place; the checksum tells. */
+  for (i = 0; i < desc.cnt; i++)
+    {
+      block_read (fs_device, log_sector (pos + 1 + i), block);
+      checksum = checksum * 31 + hash_bytes (block, sizeof block);
+    }
+  if (checksum != commit.checksum)
+    return false;
+
+  for (i = 0; i < desc.cnt; i++)
+    {
+      block_read (fs_device, log_sector (pos + 1 + i), block);
+      block_write (fs_device, desc.sectors[i], block);
+    }
+  *cntp = desc.cnt;
+  return true;
+}
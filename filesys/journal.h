@@ -0,0 +1,26 @@
+#ifndef FILESYS_JOURNAL_H
+#define FILESYS_JOURNAL_H
+
+#include <stdbool.h>
+#include "devices/block.h"
+
+/* Sectors reserved for the journal, starting at JOURNAL_SECTOR:
+   a header followed by the log. */
+#define JOURNAL_SECTORS 128
+
+void journal_init (void);
+void journal_create (void);
+void journal_recover (void);
+void journal_close (void);
+bool journal_active (void);
+void journal_print_stats (void);
+
+void journal_begin (void);
+void journal_end (void);
+int journal_suspend (void);
+void journal_resume (int depth);
+void journal_add (block_sector_t);
+bool journal_hold (block_sector_t);
+void journal_commit (void);
+
+#endif /* filesys/journal.h */
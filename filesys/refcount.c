@@ -0,0 +1,262 @@
+#include "filesys/refcount.h"
+#include <debug.h>
+#include <stdint.h>
+#include <string.h>
+#include "filesys/file.h"
+#include "filesys/filesys.h"
+#include "filesys/inode.h"
+#include "filesys/journal.h"
+#include "threads/malloc.h"
+#include "threads/synch.h"
+
+/* The reference count file holds one byte for each sector of the
+   file system device: the number of inodes that refer to the
+   sector besides its first owner.  Only data sectors of cloned
+   files are ever shared.  The file starts out holding just
+   REFCOUNT_MAGIC and grows sparsely, and a byte past its end or
+   in a hole reads as 0, so a disk without clones spends nothing
+   on it.  Being metadata, it goes through the journal.  Null if
+   the file system has no such file, which disables cloning. */
+static struct file *refcount_file;
+
+/* Identifies the reference count file.  The count of sector S is
+   at byte COUNTS_OFS + S. */
+#define REFCOUNT_MAGIC 0x52434e54
+#define COUNTS_OFS ((off_t) sizeof (unsigned))
+
+/* Serializes changes to the reference count file.  Acquire it
+   after every other file system lock except those of the file's
+   own inode. */
+static struct lock refcount_lock;
+
+/* Counts read by refcount_put().  Protected by refcount_lock. */
+static uint8_t put_counts[BLOCK_SECTOR_SIZE];
+
+/* Initializes the reference count module. */
+void
+refcount_init (void)
+{
+  lock_init (&refcount_lock);
+}
+
+/* Creates a reference count file with no counts on disk. */
+void
+refcount_create (void)
+{
+  unsigned magic = REFCOUNT_MAGIC;
+  struct file *file;
+
+  if (!inode_create (REFCOUNT_SECTOR, 0, DATA))
+    PANIC ("reference count file creation failed");
+  file = file_open (inode_open (REFCOUNT_SECTOR));
+  if (file == NULL
+      || file_write_at (file, &magic, sizeof magic, 0) != sizeof magic)
+    PANIC ("reference count file creation failed");
+  file_close (file);
+}
+
+/* Opens the reference count file.  A file system formatted
+   before clones existed may use REFCOUNT_SECTOR for anything, so
+   the file is only trusted if it is a data inode that starts
+   with REFCOUNT_MAGIC.  Otherwise cloning stays disabled. */
+void
+refcount_open (void)
+{
+  struct file *file = NULL;
+  unsigned magic;
+
+  if (inode_check (REFCOUNT_SECTOR, DATA))
+    file = file_open (inode_open (REFCOUNT_SECTOR));
+  if (file != NULL
+      && file_read_at (file, &magic, sizeof magic, 0) == sizeof magic
+      && magic == REFCOUNT_MAGIC)
+    refcount_file = file;
+  else
+    file_close (file);
+}
+
+/* Closes the reference count file. */
+void
+refcount_close (void)
+{
+  lock_acquire (&refcount_lock);
+  file_close (refcount_file);
+  refcount_file = NULL;
+  lock_release (&refcount_lock);
+}
+
+/* Returns true if the file system has a reference count file, so
+   that files can be cloned. */
+bool
+refcount_enabled (void)
+{
+  return refcount_file != NULL;
+}
+
+/* Returns true if the current thread holds refcount_lock, which
+   it must not while waiting for the reclamation thread, since
+   that thread drops references. */
+bool
+refcount_held (void)
+{
+  return lock_held_by_current_thread (&refcount_lock);
+}
+
+/* Reads the counts of CNT sectors starting at SECTOR into COUNTS.
+   Must be called with refcount_lock held. */
+static void
+read_counts (block_sector_t sector, uint8_t *counts, size_t cnt)
+{
+  off_t n = 0;
+
+  if (refcount_file != NULL)
+    n = file_read_at (refcount_file, counts, cnt, COUNTS_OFS + sector);
+  memset (counts + n, 0, cnt - n);
+}
+
+/* Adds DELTA, which is 1 or -1, to the counts of CNT sectors
+   starting at SECTOR, using COUNTS as a BLOCK_SECTOR_SIZE-byte
+   buffer.  Returns the number of counts changed, which is less
+   than CNT only if the disk is full.
+   Must be called with refcount_lock held. */
+static size_t
+adjust_counts (block_sector_t sector, size_t cnt, int delta, uint8_t *counts)
+{
+  size_t done = 0;
+
+  while (done < cnt)
+    {
+      size_t n = (cnt - done < BLOCK_SECTOR_SIZE
+                  ? cnt - done : BLOCK_SECTOR_SIZE);
+      off_t written;
+      size_t i;
+
+      read_counts (sector + done, counts, n);
+      for (i = 0; i < n; i++)
+        counts[i] += delta;
+      written = file_write_at (refcount_file, counts, n,
+                               COUNTS_OFS + sector + done);
+      done += written;
+      if (written < (off_t) n)
+        break;
+    }
+  return done;
+}
+
+/* Adds a reference to each of the CNT sectors starting at SECTOR,
+   which then belong to one more inode.  Adds none and returns
+   false if some sector has as many references as a count can
+   hold or the disk is full. */
+bool
+refcount_share (block_sector_t sector, size_t cnt)
+{
+  uint8_t *counts = malloc (BLOCK_SECTOR_SIZE);
+  bool success = true;
+  size_t done;
+
+  if (counts == NULL)
+    return false;
+
+  journal_begin ();
+  lock_acquire (&refcount_lock);
+  if (refcount_file == NULL)
+    success = false;
+
+  /* Check every count before changing any. */
+  for (done = 0; success && done < cnt; done += BLOCK_SECTOR_SIZE)
+    {
+      size_t n = (cnt - done < BLOCK_SECTOR_SIZE
+                  ? cnt - done : BLOCK_SECTOR_SIZE);
+      size_t i;
+
+      read_counts (sector + done, counts, n);
+      for (i = 0; i < n; i++)
+        if (counts[i] == UINT8_MAX)
+          success = false;
+    }
+
+  if (success)
+    {
+      done = adjust_counts (sector, cnt, 1, counts);
+      if (done < cnt)
+        {
+          adjust_counts (sector, done, -1, counts);
+          success = false;
+        }
+    }
+  lock_release (&refcount_lock);
+  journal_end ();
+
+  free (counts);
+  return success;
+}
+
+/* Returns true if SECTOR belongs to more than one inode. */
+bool
+refcount_shared (block_sector_t sector)
+{
+  uint8_t count;
+
+  lock_acquire (&refcount_lock);
+  read_counts (sector, &count, 1);
+  lock_release (&refcount_lock);
+  return count > 0;
+}
+
+/* Reads the counts of up to CNT sectors starting at SECTOR into
+   put_counts and returns the length of the leading run of them
+   that are alike in being zero or not.  Sets *SHARED to true if
+   they are not zero.  Must be called with refcount_lock held. */
+static size_t
+leading_run (block_sector_t sector, size_t cnt, bool *shared)
+{
+  size_t n;
+
+  if (cnt > BLOCK_SECTOR_SIZE)
+    cnt = BLOCK_SECTOR_SIZE;
+  read_counts (sector, put_counts, cnt);
+  *shared = put_counts[0] > 0;
+  for (n = 1; n < cnt && (put_counts[n] > 0) == *shared; n++)
+    continue;
+  return n;
+}
+
+/* Drops one inode's reference to each sector in the leading run
+   of the CNT sectors starting at SECTOR that are alike in whether
+   another inode shares them, and returns the length of the run.
+   Sets *SHARED to true if the run's sectors still belong to
+   another inode, false if the caller was their last owner and
+   should free them.  Sectors that were never shared, including
+   every sector past the end of the file, are recognized without
+   writing anything. */
+size_t
+refcount_put (block_sector_t sector, size_t cnt, bool *shared)
+{
+  size_t n;
+
+  ASSERT (cnt > 0);
+
+  lock_acquire (&refcount_lock);
+  if (refcount_file == NULL
+      || COUNTS_OFS + (off_t) sector >= file_length (refcount_file))
+    {
+      lock_release (&refcount_lock);
+      *shared = false;
+      return cnt;
+    }
+  n = leading_run (sector, cnt, shared);
+  lock_release (&refcount_lock);
+  if (!*shared)
+    return n;
+
+  /* Changing counts takes a journal operation, which must begin
+     before refcount_lock is acquired, so look again afterward. */
+  journal_begin ();
+  lock_acquire (&refcount_lock);
+  n = leading_run (sector, n, shared);
+  if (*shared)
+    adjust_counts (sector, n, -1, put_counts);
+  lock_release (&refcount_lock);
+  journal_end ();
+  return n;
+}
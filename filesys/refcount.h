@@ -0,0 +1,19 @@
+#ifndef FILESYS_REFCOUNT_H
+#define FILESYS_REFCOUNT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include "devices/block.h"
+
+void refcount_init (void);
+void refcount_create (void);
+void refcount_open (void);
+void refcount_close (void);
+bool refcount_enabled (void);
+bool refcount_held (void);
+
+bool refcount_share (block_sector_t, size_t cnt);
+bool refcount_shared (block_sector_t);
+size_t refcount_put (block_sector_t, size_t cnt, bool *shared);
+
+#endif /* filesys/refcount.h */
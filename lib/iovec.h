@@ -0,0 +1,19 @@
+#ifndef __LIB_IOVEC_H
+#define __LIB_IOVEC_H
+
+/* Buffer descriptors for the readv() and writev() system calls,
+   shared by the kernel and user programs. */
+
+#include <stddef.h>
+
+/* Most buffers that one readv() or writev() call accepts. */
+#define IOV_MAX 64
+
+/* One buffer of a scatter/gather transfer. */
+struct iovec
+  {
+    void *iov_base;             /* Start of buffer. */
+    size_t iov_len;             /* Size of buffer in bytes. */
+  };
+
+#endif /* lib/iovec.h */
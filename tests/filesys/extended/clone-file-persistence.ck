@@ -0,0 +1,10 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+use tests::random;
+my ($data) = random_bytes (9000);
+check_archive ({"src" => [substr ($data, 0, 6000)],
+		"dst" => [substr ($data, 0, 1000) . substr ($data, 6000, 1500)
+			  . substr ($data, 2500, 3500) . substr ($data, 6000, 3000)]});
+pass;
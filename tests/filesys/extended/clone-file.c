@@ -0,0 +1,44 @@
+/* Clones a file with clone_file(), overwrites part of the clone
+   and appends to it, and checks that the original is unchanged
+   and the clone has both the shared and the new data. */
+
+#include <random.h>
+#include <string.h>
+#include <syscall.h>
+#include "tests/lib.h"
+#include "tests/main.h"
+
+static char buf[9000];
+static char expected[9000];
+
+void
+test_main (void) 
+{
+  int fd;
+
+  random_bytes (buf, sizeof buf);
+  CHECK (create ("src", 0), "create \"src\"");
+  CHECK ((fd = open ("src")) > 1, "open \"src\"");
+  CHECK (write (fd, buf, 6000) == 6000, "write \"src\"");
+  CHECK (clone_file (fd, "dst") == 0, "clone \"src\" to \"dst\"");
+  CHECK (clone_file (fd, "dst") == -1,
+         "clone \"src\" to \"dst\" again (must fail)");
+  CHECK (clone_file (2, "other") == -1, "clone bad fd (must fail)");
+  msg ("close \"src\"");
+  close (fd);
+
+  CHECK ((fd = open ("dst")) > 1, "open \"dst\"");
+  CHECK (filesize (fd) == 6000, "filesize \"dst\" (must be 6000)");
+  seek (fd, 1000);
+  CHECK (write (fd, buf + 6000, 1500) == 1500,
+         "overwrite 1500 bytes of \"dst\"");
+  seek (fd, 6000);
+  CHECK (write (fd, buf + 6000, 3000) == 3000, "append 3000 bytes to \"dst\"");
+  msg ("close \"dst\"");
+  close (fd);
+
+  check_file ("src", buf, 6000);
+  memcpy (expected, buf, sizeof expected);
+  memcpy (expected + 1000, buf + 6000, 1500);
+  check_file ("dst", expected, sizeof expected);
+}
@@ -0,0 +1,27 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected (IGNORE_EXIT_CODES => 1, [<<'EOF']);
+(clone-file) begin
+(clone-file) create "src"
+(clone-file) open "src"
+(clone-file) write "src"
+(clone-file) clone "src" to "dst"
+(clone-file) clone "src" to "dst" again (must fail)
+(clone-file) clone bad fd (must fail)
+(clone-file) close "src"
+(clone-file) open "dst"
+(clone-file) filesize "dst" (must be 6000)
+(clone-file) overwrite 1500 bytes of "dst"
+(clone-file) append 3000 bytes to "dst"
+(clone-file) close "dst"
+(clone-file) open "src" for verification
+(clone-file) verified contents of "src"
+(clone-file) close "src"
+(clone-file) open "dst" for verification
+(clone-file) verified contents of "dst"
+(clone-file) close "dst"
+(clone-file) end
+EOF
+pass;
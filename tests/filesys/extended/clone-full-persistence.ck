@@ -0,0 +1,8 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+use tests::random;
+my ($data) = random_bytes (20000);
+check_archive ({"dst" => [$data], "after" => [$data]});
+pass;
@@ -0,0 +1,48 @@
+/* Clones a file, removes the original so that the reclamation
+   thread has to drop its references to the shared sectors, and
+   then fills the disk, so that allocation waits for that thread
+   in the middle of a write.  Checks that the clone keeps its
+   data and that the space becomes usable again. */
+
+#include <random.h>
+#include <syscall.h>
+#include "tests/lib.h"
+#include "tests/main.h"
+
+static char buf[20000];
+static char block[4096];
+
+void
+test_main (void) 
+{
+  int fd;
+  int total = 0;
+  int n;
+
+  random_bytes (buf, sizeof buf);
+  CHECK (create ("src", 0), "create \"src\"");
+  CHECK ((fd = open ("src")) > 1, "open \"src\"");
+  CHECK (write (fd, buf, sizeof buf) == sizeof buf, "write \"src\"");
+  CHECK (clone_file (fd, "dst") == 0, "clone \"src\" to \"dst\"");
+  msg ("close \"src\"");
+  close (fd);
+  CHECK (remove ("src"), "remove \"src\"");
+
+  CHECK (create ("fill", 0), "create \"fill\"");
+  CHECK ((fd = open ("fill")) > 1, "open \"fill\"");
+  msg ("fill the disk");
+  while ((n = write (fd, block, sizeof block)) > 0)
+    total += n;
+  CHECK (total > 0, "wrote something to \"fill\"");
+  msg ("close \"fill\"");
+  close (fd);
+
+  check_file ("dst", buf, sizeof buf);
+
+  CHECK (remove ("fill"), "remove \"fill\"");
+  CHECK (create ("after", 0), "create \"after\"");
+  CHECK ((fd = open ("after")) > 1, "open \"after\"");
+  CHECK (write (fd, buf, sizeof buf) == sizeof buf, "write \"after\"");
+  msg ("close \"after\"");
+  close (fd);
+}
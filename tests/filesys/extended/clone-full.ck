@@ -0,0 +1,28 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected (IGNORE_EXIT_CODES => 1, [<<'EOF']);
+(clone-full) begin
+(clone-full) create "src"
+(clone-full) open "src"
+(clone-full) write "src"
+(clone-full) clone "src" to "dst"
+(clone-full) close "src"
+(clone-full) remove "src"
+(clone-full) create "fill"
+(clone-full) open "fill"
+(clone-full) fill the disk
+(clone-full) wrote something to "fill"
+(clone-full) close "fill"
+(clone-full) open "dst" for verification
+(clone-full) verified contents of "dst"
+(clone-full) close "dst"
+(clone-full) remove "fill"
+(clone-full) create "after"
+(clone-full) open "after"
+(clone-full) write "after"
+(clone-full) close "after"
+(clone-full) end
+EOF
+pass;
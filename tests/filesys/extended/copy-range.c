@@ -0,0 +1,47 @@
+/* Copies a file with copy_file_range(), in one call and then in
+   two pieces at different offsets, and checks the rules for
+   copying within one file. */
+
+#include <random.h>
+#include <syscall.h>
+#include "tests/lib.h"
+#include "tests/main.h"
+
+static char buf[5000];
+
+void
+test_main (void) 
+{
+  int in_fd, out_fd;
+
+  random_bytes (buf, sizeof buf);
+  CHECK (create ("src", 0), "create \"src\"");
+  CHECK ((in_fd = open ("src")) > 1, "open \"src\"");
+  CHECK (write (in_fd, buf, sizeof buf) == sizeof buf, "write \"src\"");
+
+  CHECK (create ("dst", 0), "create \"dst\"");
+  CHECK ((out_fd = open ("dst")) > 1, "open \"dst\"");
+  CHECK (copy_file_range (in_fd, 0, out_fd, 0, 100000) == sizeof buf,
+         "copy \"src\" to \"dst\"");
+  CHECK (tell (out_fd) == 0, "tell \"dst\" (must be 0)");
+  CHECK (copy_file_range (in_fd, sizeof buf, out_fd, 0, 10) == 0,
+         "copy from end of \"src\" (must return 0)");
+  CHECK (copy_file_range (in_fd, 0, in_fd, 100, 200) == -1,
+         "copy overlapping ranges (must return -1)");
+  msg ("close \"dst\"");
+  close (out_fd);
+  check_file ("dst", buf, sizeof buf);
+
+  CHECK (create ("dst2", 0), "create \"dst2\"");
+  CHECK ((out_fd = open ("dst2")) > 1, "open \"dst2\"");
+  CHECK (copy_file_range (in_fd, 3001, out_fd, 3001, 1999) == 1999,
+         "copy tail of \"src\" to \"dst2\"");
+  CHECK (copy_file_range (in_fd, 0, out_fd, 0, 3001) == 3001,
+         "copy head of \"src\" to \"dst2\"");
+  msg ("close \"dst2\"");
+  close (out_fd);
+  check_file ("dst2", buf, sizeof buf);
+
+  msg ("close \"src\"");
+  close (in_fd);
+}
@@ -0,0 +1,31 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected (IGNORE_EXIT_CODES => 1, [<<'EOF']);
+(copy-range) begin
+(copy-range) create "src"
+(copy-range) open "src"
+(copy-range) write "src"
+(copy-range) create "dst"
+(copy-range) open "dst"
+(copy-range) copy "src" to "dst"
+(copy-range) tell "dst" (must be 0)
+(copy-range) copy from end of "src" (must return 0)
+(copy-range) copy overlapping ranges (must return -1)
+(copy-range) close "dst"
+(copy-range) open "dst" for verification
+(copy-range) verified contents of "dst"
+(copy-range) close "dst"
+(copy-range) create "dst2"
+(copy-range) open "dst2"
+(copy-range) copy tail of "src" to "dst2"
+(copy-range) copy head of "src" to "dst2"
+(copy-range) close "dst2"
+(copy-range) open "dst2" for verification
+(copy-range) verified contents of "dst2"
+(copy-range) close "dst2"
+(copy-range) close "src"
+(copy-range) end
+EOF
+pass;
@@ -0,0 +1,72 @@
+/* Creates enough files in one directory for it to be indexed,
+   removes every other one, recreates them, and checks that
+   lookups find exactly the files that exist at each step. */
+
+#include <stdio.h>
+#include <syscall.h>
+#include "tests/lib.h"
+#include "tests/main.h"
+
+#define FILE_CNT 200
+
+/* Checks that the files named /d/fN exist for every odd N, and
+   also for every even N if EVEN_EXIST. */
+static void
+check_lookups (bool even_exist) 
+{
+  char name[32];
+  int i;
+
+  for (i = 0; i < FILE_CNT; i++) 
+    {
+      bool exists = i % 2 == 1 || even_exist;
+      int fd;
+
+      snprintf (name, sizeof name, "/d/f%d", i);
+      fd = open (name);
+      if (exists && fd < 2)
+        fail ("open \"%s\" failed", name);
+      else if (!exists && fd != -1)
+        fail ("open \"%s\" succeeded after remove", name);
+      if (fd > 1)
+        close (fd);
+    }
+}
+
+void
+test_main (void) 
+{
+  char name[32];
+  int i;
+
+  CHECK (mkdir ("/d"), "mkdir \"/d\"");
+
+  msg ("create %d files in \"/d\"", FILE_CNT);
+  for (i = 0; i < FILE_CNT; i++) 
+    {
+      snprintf (name, sizeof name, "/d/f%d", i);
+      if (!create (name, 0))
+        fail ("create \"%s\" failed", name);
+    }
+  CHECK (!create ("/d/f7", 0), "create \"/d/f7\" again (must return false)");
+
+  msg ("remove even-numbered files");
+  for (i = 0; i < FILE_CNT; i += 2) 
+    {
+      snprintf (name, sizeof name, "/d/f%d", i);
+      if (!remove (name))
+        fail ("remove \"%s\" failed", name);
+    }
+  msg ("check lookups");
+  check_lookups (false);
+
+  msg ("recreate even-numbered files");
+  for (i = 0; i < FILE_CNT; i += 2) 
+    {
+      snprintf (name, sizeof name, "/d/f%d", i);
+      if (!create (name, 0))
+        fail ("create \"%s\" failed", name);
+    }
+  msg ("check lookups");
+  check_lookups (true);
+}
@@ -0,0 +1,16 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected (IGNORE_EXIT_CODES => 1, [<<'EOF']);
+(dir-index) begin
+(dir-index) mkdir "/d"
+(dir-index) create 200 files in "/d"
+(dir-index) create "/d/f7" again (must return false)
+(dir-index) remove even-numbered files
+(dir-index) check lookups
+(dir-index) recreate even-numbered files
+(dir-index) check lookups
+(dir-index) end
+EOF
+pass;
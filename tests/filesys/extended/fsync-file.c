@@ -0,0 +1,30 @@
+/* Writes a file and forces it to disk with fsync() and sync().
+   Also checks that fsync() rejects descriptors that do not
+   refer to open files. */
+
+#include <random.h>
+#include <stdio.h>
+#include <syscall.h>
+#include "tests/lib.h"
+#include "tests/main.h"
+
+static char buf[1234];
+
+void
+test_main (void) 
+{
+  int fd;
+
+  random_bytes (buf, sizeof buf);
+  CHECK (create ("data", 0), "create \"data\"");
+  CHECK ((fd = open ("data")) > 1, "open \"data\"");
+  CHECK (write (fd, buf, sizeof buf) == sizeof buf, "write \"data\"");
+  CHECK (fsync (fd) == 0, "fsync \"data\"");
+  CHECK (fsync (STDOUT_FILENO) == -1, "fsync stdout (must return -1)");
+  CHECK (fsync (fd + 10) == -1, "fsync unopened fd (must return -1)");
+  msg ("sync");
+  sync ();
+  msg ("close \"data\"");
+  close (fd);
+  check_file ("data", buf, sizeof buf);
+}
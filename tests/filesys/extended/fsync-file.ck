@@ -0,0 +1,20 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected (IGNORE_EXIT_CODES => 1, [<<'EOF']);
+(fsync-file) begin
+(fsync-file) create "data"
+(fsync-file) open "data"
+(fsync-file) write "data"
+(fsync-file) fsync "data"
+(fsync-file) fsync stdout (must return -1)
+(fsync-file) fsync unopened fd (must return -1)
+(fsync-file) sync
+(fsync-file) close "data"
+(fsync-file) open "data" for verification
+(fsync-file) verified contents of "data"
+(fsync-file) close "data"
+(fsync-file) end
+EOF
+pass;
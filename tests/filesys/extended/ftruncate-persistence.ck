@@ -0,0 +1,8 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+use tests::random;
+my ($data) = random_bytes (80000);
+check_archive ({"big" => [substr ($data, 0, 1000) . ("\0" x 2000)]});
+pass;
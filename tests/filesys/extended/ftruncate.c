@@ -0,0 +1,33 @@
+/* Shrinks a file that reaches into its doubly indirect block with
+   ftruncate(), grows it again, and checks that the part past the
+   cut reads back as zeros. */
+
+#include <random.h>
+#include <string.h>
+#include <syscall.h>
+#include "tests/lib.h"
+#include "tests/main.h"
+
+static char buf[80000];
+
+void
+test_main (void) 
+{
+  int fd;
+
+  random_bytes (buf, sizeof buf);
+  CHECK (create ("big", 0), "create \"big\"");
+  CHECK ((fd = open ("big")) > 1, "open \"big\"");
+  CHECK (write (fd, buf, sizeof buf) == sizeof buf, "write \"big\"");
+
+  CHECK (ftruncate (fd, 1000) == 0, "truncate \"big\" to 1000 bytes");
+  CHECK (filesize (fd) == 1000, "filesize \"big\" (must be 1000)");
+  CHECK (tell (fd) == sizeof buf, "tell \"big\" (must be unchanged)");
+  CHECK (ftruncate (fd, 3000) == 0, "extend \"big\" to 3000 bytes");
+  CHECK (ftruncate (2, 0) == -1, "truncate bad fd (must return -1)");
+  msg ("close \"big\"");
+  close (fd);
+
+  memset (buf + 1000, 0, 2000);
+  check_file ("big", buf, 3000);
+}
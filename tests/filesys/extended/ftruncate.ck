@@ -0,0 +1,21 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected (IGNORE_EXIT_CODES => 1, [<<'EOF']);
+(ftruncate) begin
+(ftruncate) create "big"
+(ftruncate) open "big"
+(ftruncate) write "big"
+(ftruncate) truncate "big" to 1000 bytes
+(ftruncate) filesize "big" (must be 1000)
+(ftruncate) tell "big" (must be unchanged)
+(ftruncate) extend "big" to 3000 bytes
+(ftruncate) truncate bad fd (must return -1)
+(ftruncate) close "big"
+(ftruncate) open "big" for verification
+(ftruncate) verified contents of "big"
+(ftruncate) close "big"
+(ftruncate) end
+EOF
+pass;
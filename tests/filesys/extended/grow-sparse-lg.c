@@ -0,0 +1,46 @@
+/* Seeks far past the end of a file, larger than the whole file
+   system device, and writes a single byte.  Only the sector that
+   was written may be allocated, so this succeeds even though the
+   file is bigger than the disk, and the hole reads back as
+   zeros. */
+
+#include <string.h>
+#include <syscall.h>
+#include "tests/lib.h"
+#include "tests/main.h"
+
+#define FILE_SIZE (6 * 1024 * 1024)
+
+static char buf[4096];
+
+void
+test_main (void) 
+{
+  const char *file_name = "sparse";
+  char one = 1;
+  char c;
+  size_t i;
+  int fd;
+
+  CHECK (create (file_name, 0), "create \"%s\"", file_name);
+  CHECK ((fd = open (file_name)) > 1, "open \"%s\"", file_name);
+  msg ("seek \"%s\" to %d", file_name, FILE_SIZE - 1);
+  seek (fd, FILE_SIZE - 1);
+  CHECK (write (fd, &one, 1) == 1, "write \"%s\"", file_name);
+  CHECK (filesize (fd) == FILE_SIZE, "filesize \"%s\"", file_name);
+
+  msg ("read hole in \"%s\"", file_name);
+  seek (fd, FILE_SIZE / 2);
+  if (read (fd, buf, sizeof buf) != sizeof buf)
+    fail ("read of hole in \"%s\" failed", file_name);
+  for (i = 0; i < sizeof buf; i++)
+    if (buf[i] != 0)
+      fail ("byte %zu of hole in \"%s\" is %d, not 0", i, file_name, buf[i]);
+
+  seek (fd, FILE_SIZE - 1);
+  CHECK (read (fd, &c, 1) == 1 && c == 1, "read back last byte of \"%s\"",
+         file_name);
+  msg ("close \"%s\"", file_name);
+  close (fd);
+  CHECK (remove (file_name), "remove \"%s\"", file_name);
+}
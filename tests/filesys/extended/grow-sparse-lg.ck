@@ -0,0 +1,18 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected (IGNORE_EXIT_CODES => 1, [<<'EOF']);
+(grow-sparse-lg) begin
+(grow-sparse-lg) create "sparse"
+(grow-sparse-lg) open "sparse"
+(grow-sparse-lg) seek "sparse" to 6291455
+(grow-sparse-lg) write "sparse"
+(grow-sparse-lg) filesize "sparse"
+(grow-sparse-lg) read hole in "sparse"
+(grow-sparse-lg) read back last byte of "sparse"
+(grow-sparse-lg) close "sparse"
+(grow-sparse-lg) remove "sparse"
+(grow-sparse-lg) end
+EOF
+pass;
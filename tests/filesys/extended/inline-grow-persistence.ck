@@ -0,0 +1,10 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+use tests::random;
+my ($data) = random_bytes (1000);
+check_archive ({"tiny" => [substr ($data, 0, 50)],
+		"small" => [substr ($data, 0, 100) . ("\0" x 500)
+			    . substr ($data, 600, 400)]});
+pass;
@@ -0,0 +1,41 @@
+/* Writes files small enough to live inside their inodes, grows
+   one of them past that size with a write that leaves a gap, and
+   checks that both read back correctly. */
+
+#include <random.h>
+#include <string.h>
+#include <syscall.h>
+#include "tests/lib.h"
+#include "tests/main.h"
+
+static char buf[1000];
+
+void
+test_main (void) 
+{
+  char expected[1000];
+  int fd;
+
+  random_bytes (buf, sizeof buf);
+  CHECK (create ("tiny", 0), "create \"tiny\"");
+  CHECK ((fd = open ("tiny")) > 1, "open \"tiny\"");
+  CHECK (write (fd, buf, 50) == 50, "write \"tiny\"");
+  msg ("close \"tiny\"");
+  close (fd);
+
+  CHECK (create ("small", 0), "create \"small\"");
+  CHECK ((fd = open ("small")) > 1, "open \"small\"");
+  CHECK (write (fd, buf, 100) == 100, "write 100 bytes to \"small\"");
+  CHECK (filesize (fd) == 100, "filesize \"small\" (must be 100)");
+  seek (fd, 600);
+  CHECK (write (fd, buf + 600, 400) == 400,
+         "write 400 bytes at offset 600 of \"small\"");
+  CHECK (filesize (fd) == 1000, "filesize \"small\" (must be 1000)");
+  msg ("close \"small\"");
+  close (fd);
+
+  check_file ("tiny", buf, 50);
+  memcpy (expected, buf, sizeof expected);
+  memset (expected + 100, 0, 500);
+  check_file ("small", expected, sizeof expected);
+}
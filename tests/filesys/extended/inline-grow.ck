@@ -0,0 +1,26 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected (IGNORE_EXIT_CODES => 1, [<<'EOF']);
+(inline-grow) begin
+(inline-grow) create "tiny"
+(inline-grow) open "tiny"
+(inline-grow) write "tiny"
+(inline-grow) close "tiny"
+(inline-grow) create "small"
+(inline-grow) open "small"
+(inline-grow) write 100 bytes to "small"
+(inline-grow) filesize "small" (must be 100)
+(inline-grow) write 400 bytes at offset 600 of "small"
+(inline-grow) filesize "small" (must be 1000)
+(inline-grow) close "small"
+(inline-grow) open "tiny" for verification
+(inline-grow) verified contents of "tiny"
+(inline-grow) close "tiny"
+(inline-grow) open "small" for verification
+(inline-grow) verified contents of "small"
+(inline-grow) close "small"
+(inline-grow) end
+EOF
+pass;
@@ -0,0 +1,50 @@
+/* Writes a file from three buffers with one writev() and reads
+   it back into buffers of different sizes with one readv(). */
+
+#include <random.h>
+#include <string.h>
+#include <syscall.h>
+#include "tests/lib.h"
+#include "tests/main.h"
+
+static char buf[3000];
+static char got[3000];
+
+void
+test_main (void) 
+{
+  struct iovec iov[3];
+  int fd;
+
+  random_bytes (buf, sizeof buf);
+  CHECK (create ("data", 0), "create \"data\"");
+  CHECK ((fd = open ("data")) > 1, "open \"data\"");
+
+  iov[0].iov_base = buf;
+  iov[0].iov_len = 100;
+  iov[1].iov_base = buf + 100;
+  iov[1].iov_len = 1900;
+  iov[2].iov_base = buf + 2000;
+  iov[2].iov_len = 1000;
+  CHECK (writev (fd, iov, 3) == sizeof buf, "writev \"data\"");
+  CHECK (tell (fd) == sizeof buf, "tell \"data\"");
+  CHECK (writev (fd, iov, IOV_MAX + 1) == -1,
+         "writev too many buffers (must return -1)");
+
+  msg ("seek \"data\" to 0");
+  seek (fd, 0);
+  iov[0].iov_base = got;
+  iov[0].iov_len = 1234;
+  iov[1].iov_base = got + 1234;
+  iov[1].iov_len = 0;
+  iov[2].iov_base = got + 1234;
+  iov[2].iov_len = 2000;
+  CHECK (readv (fd, iov, 3) == sizeof buf, "readv \"data\"");
+  if (memcmp (got, buf, sizeof buf))
+    fail ("readv returned wrong data");
+  CHECK (readv (fd, iov, 3) == 0, "readv at end of \"data\" (must return 0)");
+
+  msg ("close \"data\"");
+  close (fd);
+  check_file ("data", buf, sizeof buf);
+}
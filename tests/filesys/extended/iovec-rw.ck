@@ -0,0 +1,21 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected (IGNORE_EXIT_CODES => 1, [<<'EOF']);
+(iovec-rw) begin
+(iovec-rw) create "data"
+(iovec-rw) open "data"
+(iovec-rw) writev "data"
+(iovec-rw) tell "data"
+(iovec-rw) writev too many buffers (must return -1)
+(iovec-rw) seek "data" to 0
+(iovec-rw) readv "data"
+(iovec-rw) readv at end of "data" (must return 0)
+(iovec-rw) close "data"
+(iovec-rw) open "data" for verification
+(iovec-rw) verified contents of "data"
+(iovec-rw) close "data"
+(iovec-rw) end
+EOF
+pass;
@@ -0,0 +1,40 @@
+/* Writes a file out of order with pwrite() and reads parts of it
+   back with pread(), checking that neither moves the file
+   position. */
+
+#include <random.h>
+#include <stdio.h>
+#include <string.h>
+#include <syscall.h>
+#include "tests/lib.h"
+#include "tests/main.h"
+
+static char buf[2000];
+static char got[500];
+
+void
+test_main (void) 
+{
+  int fd;
+
+  random_bytes (buf, sizeof buf);
+  CHECK (create ("data", 0), "create \"data\"");
+  CHECK ((fd = open ("data")) > 1, "open \"data\"");
+  CHECK (pwrite (fd, buf + 1000, 1000, 1000) == 1000,
+         "pwrite second half of \"data\"");
+  CHECK (pwrite (fd, buf, 1000, 0) == 1000, "pwrite first half of \"data\"");
+  CHECK (filesize (fd) == sizeof buf, "filesize \"data\"");
+  CHECK (tell (fd) == 0, "tell \"data\" (must be 0)");
+  CHECK (pread (fd, got, sizeof got, 750) == sizeof got,
+         "pread \"data\" at offset 750");
+  if (memcmp (got, buf + 750, sizeof got))
+    fail ("pread returned wrong data");
+  CHECK (pread (fd, got, sizeof got, sizeof buf) == 0,
+         "pread at end of \"data\" (must return 0)");
+  CHECK (tell (fd) == 0, "tell \"data\" (must still be 0)");
+  CHECK (pread (STDOUT_FILENO, got, sizeof got, 0) == -1,
+         "pread stdout (must return -1)");
+  msg ("close \"data\"");
+  close (fd);
+  check_file ("data", buf, sizeof buf);
+}
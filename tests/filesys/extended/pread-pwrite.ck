@@ -0,0 +1,23 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected (IGNORE_EXIT_CODES => 1, [<<'EOF']);
+(pread-pwrite) begin
+(pread-pwrite) create "data"
+(pread-pwrite) open "data"
+(pread-pwrite) pwrite second half of "data"
+(pread-pwrite) pwrite first half of "data"
+(pread-pwrite) filesize "data"
+(pread-pwrite) tell "data" (must be 0)
+(pread-pwrite) pread "data" at offset 750
+(pread-pwrite) pread at end of "data" (must return 0)
+(pread-pwrite) tell "data" (must still be 0)
+(pread-pwrite) pread stdout (must return -1)
+(pread-pwrite) close "data"
+(pread-pwrite) open "data" for verification
+(pread-pwrite) verified contents of "data"
+(pread-pwrite) close "data"
+(pread-pwrite) end
+EOF
+pass;
@@ -137,6 +137,11 @@ struct thread
     struct hash SPageTable;
 
     void* t_esp;
+
+    /* Nesting depth of journal_begin() calls, and sectors left of
+       the room the outermost one reserved in the journal. */
+    int journal_depth;
+    int journal_credits;
     
 #ifdef USERPROG
     /* Owned by userprog/process.c. */
@@ -1,5 +1,6 @@
 #include "userprog/syscall.h"
 #include <stdio.h>
+#include <string.h>
 #include <syscall-nr.h>
 #include "threads/synch.h"
 #include "threads/interrupt.h"
@@ -16,6 +17,10 @@
 
 static void syscall_handler (struct intr_frame *);
 static bool validate_ptr(const void* ptr, int spanSize);
+static struct file* fd_to_file(int fd);
+static void pin_buffer(const void* buffer, unsigned size);
+static void unpin_buffer(const void* buffer, unsigned size);
+static bool copy_iovec(struct iovec* kiov, const struct iovec* uiov, int iovcnt);
 
 
 void
@@ -43,7 +48,7 @@ syscall_handler (struct intr_frame *f)
     exit(-1);
   }
   int32_t statusCode = *(int32_t *)(f->esp);
-  if(statusCode > SYS_INUMBER) {
+  if(statusCode > SYS_CLONE_FILE) {
     exit(-1);
   }
   int32_t* argv = f->esp;
@@ -129,6 +134,54 @@ syscall_handler (struct intr_frame *f)
   case SYS_INUMBER:
     f->eax = inumber(*(argv));
     break;
+  case SYS_FSYNC:
+    f->eax = fsync(*(argv));
+    break;
+  case SYS_SYNC:
+    sync();
+    break;
+  case SYS_PREAD:
+    if(!validate_ptr(argv+3, 1) || !validate_ptr((void *)*(argv+1), *(argv+2))) {
+      exit(-1);
+    }
+    f->eax = pread(*argv, (void *)*(argv+1), *(argv+2), *(argv+3));
+    break;
+  case SYS_PWRITE:
+    if(!validate_ptr(argv+3, 1) || !validate_ptr((void *)*(argv+1), *(argv+2))) {
+      exit(-1);
+    }
+    f->eax = pwrite(*argv, (void *)*(argv+1), *(argv+2), *(argv+3));
+    break;
+  case SYS_READV:
+    if(!validate_ptr(argv+2, 1)) {
+      exit(-1);
+    }
+    f->eax = readv(*argv, (struct iovec *)*(argv+1), *(argv+2));
+    break;
+  case SYS_WRITEV:
+    if(!validate_ptr(argv+2, 1)) {
+      exit(-1);
+    }
+    f->eax = writev(*argv, (struct iovec *)*(argv+1), *(argv+2));
+    break;
+  case SYS_COPY_FILE_RANGE:
+    if(!validate_ptr(argv+4, 1)) {
+      exit(-1);
+    }
+    f->eax = copy_file_range(*argv, *(argv+1), *(argv+2), *(argv+3), *(argv+4));
+    break;
+  case SYS_FTRUNCATE:
+    if(!validate_ptr(argv+1, 1)) {
+      exit(-1);
+    }
+    f->eax = ftruncate(*argv, *(argv+1));
+    break;
+  case SYS_CLONE_FILE:
+    if(!validate_ptr(argv+1, 1) || !validate_ptr(*(void**)(argv+1), 1)) {
+      exit(-1);
+    }
+    f->eax = clone_file(*argv, *(char**)(argv+1));
+    break;
   }
 }
 
@@ -172,6 +225,80 @@ validate_ptr(const void* ptr, int spanSize) {
   }
 }
 
+/* Returns the file open as FD in the current thread, or a null
+   pointer if FD is not an open file. */
+static struct file*
+fd_to_file(int fd) {
+  struct thread* t = thread_current();
+  if(fd < 2 || t->fdCap <= fd-2) {
+    return NULL;
+  }
+  if(t->fdTable[fd-2] == NULL || !t->fdTable[fd-2]->isFile) {
+    return NULL;
+  }
+  return t->fdTable[fd-2]->ptr.asFile;
+}
+
+/* Pins each page of the SIZE-byte user BUFFER, loading it first
+   if needed, so that file system code can touch it without
+   faulting. */
+static void
+pin_buffer(const void* buffer, unsigned size) {
+  struct thread* t = thread_current();
+  void* last = (void*)((uint32_t)buffer + size - 1);
+  if(size == 0) {
+    return;
+  }
+  for(void* i = (void*)((uint32_t)buffer & 0xFFFFF000); i <= last; i += 4096) {
+    pin_page(i, t->tid);
+  }
+}
+
+/* Unpins the pages pinned by pin_buffer(). */
+static void
+unpin_buffer(const void* buffer, unsigned size) {
+  struct thread* t = thread_current();
+  void* last = (void*)((uint32_t)buffer + size - 1);
+  if(size == 0) {
+    return;
+  }
+  for(void* i = (void*)((uint32_t)buffer & 0xFFFFF000); i <= last; i += 4096) {
+    unpin_page(i, t->tid);
+  }
+}
+
+/* Copies the IOVCNT buffer descriptors at user address UIOV into
+   KIOV, which must have room for IOV_MAX of them, checking that
+   each buffer lies in user memory.  Returns false if IOVCNT is
+   out of range or the buffers add up to more than a file can
+   hold; terminates the process on a bad pointer. */
+static bool
+copy_iovec(struct iovec* kiov, const struct iovec* uiov, int iovcnt) {
+  off_t total = 0;
+  int i;
+  if(iovcnt < 0 || iovcnt > IOV_MAX) {
+    return false;
+  }
+  if(iovcnt == 0) {
+    return true;
+  }
+  validate_ptr(uiov, 1);
+  validate_ptr((const char*)(uiov + iovcnt) - 1, 1);
+  memcpy(kiov, uiov, iovcnt * sizeof *kiov);
+  for(i = 0; i < iovcnt; i++) {
+    if(kiov[i].iov_len == 0) {
+      continue;
+    }
+    if(kiov[i].iov_len > (size_t)(INT32_MAX - total)) {
+      return false;
+    }
+    total += kiov[i].iov_len;
+    validate_ptr(kiov[i].iov_base, 1);
+    validate_ptr((const char*)kiov[i].iov_base + kiov[i].iov_len - 1, 1);
+  }
+  return true;
+}
+
 /*System Call: void halt (void)
   Terminates Pintos by calling shutdown_power_off() (declared in "threads/init.h"). This should be seldom used, because you lose some information about possible deadlock situations, etc. */
 
@@ -580,3 +707,198 @@ int inumber(int fd) {
     return thread_current()->fdTable[fd-2]->ptr.asDir->inode->sector;
   }
 }
+
+/* System Call: int fsync (int fd)
+   Writes any data of the file open as fd that is still buffered in
+   memory out to disk.  Returns 0 if successful, -1 if fd is not an
+   open file.
+   The buffer cache does not track which file owns a sector, so this
+   writes out everything that sync() would. */
+
+int fsync(int fd) {
+  if(fd == 1 || fd == 0) {
+    return -1;
+  }
+  struct thread* t = thread_current();
+  if(t->fdCap <= fd-2 || fd < 0) {
+    return -1;
+  }
+  if(thread_current()->fdTable[fd-2] == NULL || !thread_current()->fdTable[fd-2]->isFile) {
+    return -1;
+  }
+  filesys_sync();
+  return 0;
+}
+
+/* System Call: void sync (void)
+   Writes all data buffered by the file system out to disk. */
+
+void sync(void) {
+  filesys_sync();
+}
+
+/* System Call: int pread (int fd, void *buffer, unsigned size, unsigned offset)
+   Reads size bytes from the file open as fd, starting at byte offset,
+   into buffer.  The file's position is neither used nor changed.
+   Returns the number of bytes actually read (0 at or past end of file),
+   or -1 if fd is not an open file. */
+
+int pread(int fd, void *buffer, unsigned size, unsigned offset) {
+  struct file* fileToRead = fd_to_file(fd);
+  int ret;
+  if(fileToRead == NULL || (off_t) offset < 0) {
+    return -1;
+  }
+  set_page_to_accessed(buffer);
+  set_page_to_dirty(buffer);
+  pin_buffer(buffer, size);
+  ret = file_read_at(fileToRead, buffer, size, offset);
+  unpin_buffer(buffer, size);
+  return ret;
+}
+
+/* System Call: int pwrite (int fd, const void *buffer, unsigned size, unsigned offset)
+   Writes size bytes from buffer to the file open as fd, starting at
+   byte offset and extending the file if needed.  The file's position
+   is neither used nor changed.
+   Returns the number of bytes actually written, or -1 if fd is not an
+   open file. */
+
+int pwrite(int fd, const void *buffer, unsigned size, unsigned offset) {
+  struct file* fileToWrite = fd_to_file(fd);
+  int ret = 0;
+  if(fileToWrite == NULL || (off_t) offset < 0) {
+    return -1;
+  }
+  set_page_to_accessed((void*)buffer);
+  if(!fileToWrite->deny_write) {
+    pin_buffer(buffer, size);
+    ret = file_write_at(fileToWrite, buffer, size, offset);
+    unpin_buffer(buffer, size);
+  }
+  return ret;
+}
+
+/* System Call: int readv (int fd, const struct iovec *iov, int iovcnt)
+   Reads from the file open as fd into the iovcnt buffers described by
+   iov, filling each before moving to the next, as a single read().
+   Returns the number of bytes actually read (0 at end of file), or -1
+   if fd is not an open file or iovcnt is out of range. */
+
+int readv(int fd, const struct iovec *iov, int iovcnt) {
+  struct iovec kiov[IOV_MAX];
+  struct file* fileToRead = fd_to_file(fd);
+  int ret;
+  int i;
+  if(fileToRead == NULL || !copy_iovec(kiov, iov, iovcnt)) {
+    return -1;
+  }
+  for(i = 0; i < iovcnt; i++) {
+    /* Every page read into must be written out if evicted. */
+    char* last = (char*)kiov[i].iov_base + kiov[i].iov_len - 1;
+    char* page;
+    if(kiov[i].iov_len == 0) {
+      continue;
+    }
+    for(page = pg_round_down(kiov[i].iov_base); page <= last; page += PGSIZE) {
+      set_page_to_accessed(page);
+      set_page_to_dirty(page);
+    }
+  }
+  for(i = 0; i < iovcnt; i++) {
+    pin_buffer(kiov[i].iov_base, kiov[i].iov_len);
+  }
+  ret = file_readv(fileToRead, kiov, iovcnt);
+  for(i = 0; i < iovcnt; i++) {
+    unpin_buffer(kiov[i].iov_base, kiov[i].iov_len);
+  }
+  return ret;
+}
+
+/* System Call: int writev (int fd, const struct iovec *iov, int iovcnt)
+   Writes the iovcnt buffers described by iov, in order, to the file
+   open as fd, as a single write().
+   Returns the number of bytes actually written, or -1 if fd is not an
+   open file or iovcnt is out of range. */
+
+int writev(int fd, const struct iovec *iov, int iovcnt) {
+  struct iovec kiov[IOV_MAX];
+  struct file* fileToWrite = fd_to_file(fd);
+  int ret = 0;
+  int i;
+  if(fileToWrite == NULL || !copy_iovec(kiov, iov, iovcnt)) {
+    return -1;
+  }
+  if(!fileToWrite->deny_write) {
+    for(i = 0; i < iovcnt; i++) {
+      pin_buffer(kiov[i].iov_base, kiov[i].iov_len);
+    }
+    ret = file_writev(fileToWrite, kiov, iovcnt);
+    for(i = 0; i < iovcnt; i++) {
+      unpin_buffer(kiov[i].iov_base, kiov[i].iov_len);
+    }
+  }
+  return ret;
+}
+
+/* System Call: int copy_file_range (int in_fd, unsigned in_off, int out_fd, unsigned out_off, unsigned size)
+   Copies size bytes of the file open as in_fd, starting at byte in_off,
+   into the file open as out_fd starting at byte out_off, extending it
+   if needed.  The data never passes through user memory.  Neither
+   file's position is used or changed.
+   Returns the number of bytes actually copied (0 if in_off is at or
+   past the end of the input), or -1 if either fd is not an open file
+   or both name the same file and the ranges overlap. */
+
+int copy_file_range(int in_fd, unsigned in_off, int out_fd, unsigned out_off,
+                    unsigned size) {
+  struct file* in = fd_to_file(in_fd);
+  struct file* out = fd_to_file(out_fd);
+  if(in == NULL || out == NULL || (off_t) in_off < 0 || (off_t) out_off < 0) {
+    return -1;
+  }
+  if(out->deny_write) {
+    return 0;
+  }
+  /* Keep both ranges within what an off_t can address. */
+  if(size > (unsigned) (INT32_MAX - in_off)) {
+    size = INT32_MAX - in_off;
+  }
+  if(size > (unsigned) (INT32_MAX - out_off)) {
+    size = INT32_MAX - out_off;
+  }
+  return file_copy_range(in, in_off, out, out_off, size);
+}
+
+/* System Call: int ftruncate (int fd, unsigned length)
+   Sets the size of the file open as fd to length bytes.  Data past
+   length is discarded, and its blocks are freed in the background;
+   a file that grows reads back zeros in the new part.  The file
+   position is not changed.
+   Returns 0 if successful, -1 if fd is not an open file, writes to it
+   are denied, or length is too large. */
+
+int ftruncate(int fd, unsigned length) {
+  struct file* fileToTruncate = fd_to_file(fd);
+  if(fileToTruncate == NULL || fileToTruncate->deny_write
+     || (off_t) length < 0) {
+    return -1;
+  }
+  return file_truncate(fileToTruncate, length) ? 0 : -1;
+}
+
+/* System Call: int clone_file (int fd, const char *dst_path)
+   Creates a file named dst_path with the same contents as the file
+   open as fd.  The two files share their data blocks on disk until
+   either one writes them, so cloning costs about as much as
+   creating the file's index, however large it is.
+   Returns 0 if successful, -1 if fd is not an open file or the file
+   could not be created. */
+
+int clone_file(int fd, const char *dst_path) {
+  struct file* src = fd_to_file(fd);
+  if(src == NULL) {
+    return -1;
+  }
+  return filesys_clone(dst_path, file_get_inode(src)) ? 0 : -1;
+}
@@ -4,6 +4,7 @@
 #include "userprog/syscall.h"
 #include <stdio.h>
 #include <syscall-nr.h>
+#include <iovec.h>
 #include "threads/interrupt.h"
 #include "threads/thread.h"
 #include "threads/vaddr.h"
@@ -30,5 +31,15 @@ bool mkdir(const char* dir);
 bool readdir(int fd, char* name);
 bool isdir(int fd);
 int inumber(int fd);
+int fsync(int fd);
+void sync(void);
+int pread(int fd, void *buffer, unsigned size, unsigned offset);
+int pwrite(int fd, const void *buffer, unsigned size, unsigned offset);
+int readv(int fd, const struct iovec *iov, int iovcnt);
+int writev(int fd, const struct iovec *iov, int iovcnt);
+int copy_file_range(int in_fd, unsigned in_off, int out_fd, unsigned out_off,
+                    unsigned size);
+int ftruncate(int fd, unsigned length);
+int clone_file(int fd, const char *dst_path);
 
 #endif /* userprog/syscall.h */
@@ -61,14 +61,11 @@ int putPageIntoSwap(void *kpage) {
 
   bitmap_set(swap_used_vector, index_of_free_swap, 1);
 
-  // each frame is 8 sectors large. write them into swap sequentially
+  // each frame is 8 sectors large. write them into swap in one go
   lock_acquire(&swap_lock);
-  unsigned int kpageOff = 0;
-  for(unsigned int i = 0; i < SECTORS_PER_PAGE; i++, kpageOff += BLOCK_SECTOR_SIZE) {
-    block_write (swapBlock,
-		 potentialSTE->index*SECTORS_PER_PAGE + i,
-		 (char*)kpage + kpageOff);
-  }
+  block_write_multiple (swapBlock,
+			potentialSTE->index*SECTORS_PER_PAGE,
+			kpage, SECTORS_PER_PAGE);
   lock_release(&swap_lock);
   return index_of_free_swap;
 }
@@ -81,14 +78,11 @@ void* getPageFromSwap(SupPageEntry* SPTE, void* kpage) {
 
   ASSERT(SPTE->location == SWAP);
 
-  // each frame is 8 sectors large. read them out of swap one by one
+  // each frame is 8 sectors large. read them out of swap in one go
   lock_acquire(&swap_lock);
-  unsigned int kpageOff = 0;
-  for(unsigned int i = 0; i < SECTORS_PER_PAGE; i++, kpageOff += BLOCK_SECTOR_SIZE) {
-    block_read (swapBlock,
-		 SPTE->locationInSwap*SECTORS_PER_PAGE + i,
-		 (char*)kpage + kpageOff);
-  }
+  block_read_multiple (swapBlock,
+		       SPTE->locationInSwap*SECTORS_PER_PAGE,
+		       kpage, SECTORS_PER_PAGE);
   lock_release(&swap_lock);
   
   SwapTableEntry scratch;